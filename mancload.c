@@ -0,0 +1,829 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+/*
+ * Load generator for mancsrv: opens many loopback clients, sends a name,
+ * plays random legal moves at every prompt and reports the throughput and
+ * the turn latency. A client whose game ends reconnects under a new name.
+ * In burst mode the clients only connect, all at once, and wait for WELCOME.
+ * Spectators only watch the newest game and count the views they get.
+ * In churn mode each client hangs up as soon as it is seated and comes back
+ * under a new name, to load the connect/name/disconnect path alone.
+ * Idle connections are opened before the run and never send a name, they
+ * only make the server watch more sockets while the clients play.
+ * With an admin port, the server stats are scraped before and after the
+ * run to report its side of the work, and every scrape in between hangs up
+ * without reading the reply, which the server has to survive.
+ */
+
+#define MAXNAME 80  /* as in mancsrv.c */
+#define MAXPITS 16    /* as in mancsrv.c, the pits per side of a game are sent with its state */
+#define MAXMESSAGE (MAXNAME + 50)
+#define BUFSIZE 65536   /* input buffered per client, a game state is MAXNAME + 100 bytes per row */
+#define MAXEVENTS 256
+#define STATSIZE 65536  /* largest stats reply read from the admin port */
+
+#define FRAME_HEADER 5  /* the binary protocol of mancsrv.c */
+#define FRAME_WELCOME 2
+#define FRAME_NAME 3
+#define FRAME_MOVE 4
+#define FRAME_INVALID_PIT 6
+#define FRAME_INVALID_NAME 7
+#define FRAME_STATE 8
+
+struct client {
+    int fd;
+    char name[MAXNAME + 1];
+    int seated; /* set to 1 once the first game state listing this client arrived */
+    int binary; /* set to 1 once the client switched to the binary protocol */
+    int watcher;    /* set to 1 if the client is a spectator */
+    int pits[MAXPITS];  /* this client's pits as of the last game state */
+    int npits;  /* pits per side of its game, 0 before its first game state */
+    double connected;   /* time the connection was started */
+    double moved;   /* time the last move was sent, 0 if none is pending */
+    char buf[BUFSIZE];
+    int inbuf;
+};
+
+/*
+ * Server stats scraped from its admin port, the lines starting with server_names.
+ */
+enum { SRV_MOVES, SRV_SYSCALLS, SRV_LOOPS, SRV_BYTES_OUT, SRV_BYTES_FORMATTED, SRV_LOOP_SECONDS,
+       SRV_FLUSH_SECONDS, SRV_ALLOCATIONS, SRV_RESIDENT, NSERVER };
+const char *server_names[NSERVER] = { "\nmancsrv_moves_total ", "\nmancsrv_syscalls_total ", "\nmancsrv_loops_total ",
+                                      "\nmancsrv_bytes_out_total ", "\nmancsrv_bytes_formatted_total ",
+                                      "\nmancsrv_stage_seconds_sum{stage=\"loop\"} ",
+                                      "\nmancsrv_stage_seconds_sum{stage=\"flush\"} ",
+                                      "\nmancsrv_allocations_total ", "\nmancsrv_resident_bytes " };
+
+/*
+ * One load thread: its own epoll instance, its clients and its counters,
+ * added up once the run is over.
+ */
+struct shard {
+    pthread_t tid;
+    int id;
+    int epfd;
+    struct client *clients;
+    int nclients;
+    int nwatchers;  /* spectators, the last nwatchers of clients */
+    int nnames; /* names used so far, each name is unique across the run */
+    unsigned int seed;
+
+    long connects;  /* connections started */
+    long handshakes;    /* clients seated in a game */
+    long invalid_names;
+    long invalid_pits;
+    long moves; /* game states received in answer to a move */
+    long games; /* clients whose game ended */
+    long views; /* boards received by the spectators */
+    long welcomed;  /* burst mode: clients that got WELCOME */
+    long failed;    /* burst mode: clients closed before WELCOME */
+    double last_welcome;    /* burst mode: time the last WELCOME arrived */
+    double *latency;    /* turn latencies in seconds, move sent to game state received,
+                           or in burst mode connect started to WELCOME received */
+    long nlatency;
+    long latcap;
+};
+
+const char *host = "127.0.0.1";
+int port = 3000;
+int nclients = 1000;    /* -c: number of clients kept connected */
+int nthreads = 1;   /* -t: number of load threads */
+int seconds = 10;   /* -d: length of the run */
+int binary = 0; /* -b: speak the binary protocol */
+int burst = 0;  /* -B: only connect all clients at once and time their WELCOME */
+int nwatchers = 0;  /* -W: number of spectators kept connected besides the clients */
+int admin_port = 0; /* -A: admin port of the server, 0 to not scrape its stats */
+int nidle = 0;  /* -I: number of idle connections held open during the run */
+int churn = 0;  /* -R: clients hang up once seated and reconnect */
+double started;
+double deadline;
+struct sockaddr_in server;
+
+void parseargs(int argc, char **argv);
+double now();
+void *run_shard(void *arg);
+void open_client(struct shard *s, struct client *c);
+void close_client(struct client *c);
+int read_client(struct shard *s, struct client *c);
+int read_text(struct shard *s, struct client *c, char *msg);
+int read_frame(struct shard *s, struct client *c, int type, unsigned char *payload, int len);
+void read_state(struct shard *s, struct client *c, unsigned char *payload, int len);
+void read_board(struct shard *s, struct client *c, char *board);
+void got_state(struct shard *s, struct client *c);
+void add_latency(struct shard *s, double latency);
+void send_move(struct shard *s, struct client *c);
+int send_all(struct client *c, const char *buf, int len);
+int send_frame(struct client *c, int type, const char *payload, int len);
+int get_varint(const unsigned char *buf, int n, unsigned int *v);
+int compare_latency(const void *a, const void *b);
+void report(struct shard *shards, double elapsed, double running);
+int connect_admin();
+int scrape(double *values);
+void hang_up_scrape();
+void report_server(double *before, double *after);
+int *open_idle(int n);
+
+
+int main(int argc, char **argv) {
+    parseargs(argc, argv);
+
+    memset(&server, '\0', sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "%s: bad address %s\n", argv[0], host);
+        exit(1);
+    }
+
+    struct shard *shards = calloc(nthreads, sizeof(struct shard));
+    if (shards == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int *idle = open_idle(nidle);
+    double before[NSERVER], after[NSERVER];
+    if (admin_port != 0 && scrape(before) == -1) {
+        fprintf(stderr, "%s: no stats on admin port %d\n", argv[0], admin_port);
+        exit(1);
+    }
+    started = now();
+    deadline = started + seconds;
+    for (int i = 0; i < nthreads; i++) {
+        shards[i].id = i;
+        shards[i].nclients = nclients / nthreads + (i < nclients % nthreads);
+        shards[i].nwatchers = nwatchers / nthreads + (i < nwatchers % nthreads);
+        shards[i].seed = i + 1;
+        if ((errno = pthread_create(&shards[i].tid, NULL, run_shard, &shards[i])) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    while (admin_port != 0 && burst == 0 && now() + 1 < deadline) {
+        usleep(500000);
+        hang_up_scrape();
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(shards[i].tid, NULL);
+    }
+
+    report(shards, now() - started, seconds);
+    if (admin_port != 0) {
+        if (scrape(after) == -1) {  // the server died meanwhile
+            printf("server        no stats on admin port %d\n", admin_port);
+            return 1;
+        }
+        report_server(before, after);
+    }
+    for (int i = 0; i < nidle; i++) {   // after the scrape, the server has to close them too
+        close(idle[i]);
+    }
+    free(idle);
+    return 0;
+}
+
+void parseargs(int argc, char **argv) {
+    int c, status = 0;
+    while ((c = getopt(argc, argv, "h:p:c:t:d:bBW:A:I:R")) != EOF) {
+        switch (c) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 0);
+                break;
+            case 'c':
+                nclients = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                nthreads = strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                seconds = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            case 'B':
+                burst = 1;
+                break;
+            case 'W':
+                nwatchers = strtol(optarg, NULL, 0);
+                break;
+            case 'A':
+                admin_port = strtol(optarg, NULL, 0);
+                break;
+            case 'I':
+                nidle = strtol(optarg, NULL, 0);
+                break;
+            case 'R':
+                churn = 1;
+                break;
+            default:
+                status++;
+        }
+    }
+    if (status || optind != argc || nclients < 1 || nthreads < 1 || seconds < 1 || nwatchers < 0 || nidle < 0) {
+        fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-t threads] [-d seconds] [-b] [-B]\n"
+                        "       [-W watchers] [-A adminport] [-I idle] [-R]\n", argv[0]);
+        exit(1);
+    }
+    if (nthreads > nclients) {
+        nthreads = nclients;
+    }
+}
+
+/*
+ * Return the monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run the clients of shard s until the deadline.
+ */
+void *run_shard(void *arg) {
+    struct shard *s = arg;
+    struct epoll_event events[MAXEVENTS];
+
+    if ((s->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    int total = s->nclients + s->nwatchers;
+    if ((s->clients = calloc(total, sizeof(struct client))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < total; i++) {
+        s->clients[i].watcher = (i >= s->nclients);
+        open_client(s, &s->clients[i]);
+    }
+
+    double t;
+    while ((t = now()) < deadline && (burst == 0 || s->welcomed + s->failed < s->nclients)) {
+        int n = epoll_wait(s->epfd, events, MAXEVENTS, (int)((deadline - t) * 1000) + 1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            if (read_client(s, c) == -1) {  // the game is over or the name was refused, start over
+                close_client(c);
+                if (burst == 1) {
+                    s->failed++;
+                } else {
+                    open_client(s, c);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < total; i++) {
+        close_client(&s->clients[i]);
+    }
+    close(s->epfd);
+    return NULL;
+}
+
+/*
+ * Start a new connection for client c under a new name.
+ */
+void open_client(struct shard *s, struct client *c) {
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+        perror("socket");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+
+    snprintf(c->name, sizeof(c->name), "bot%d_%d", s->id, s->nnames++);
+    c->seated = 0;
+    c->binary = 0;
+    c->npits = 0;
+    c->moved = 0;
+    c->inbuf = 0;
+    c->connected = now();
+    s->connects++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/*
+ * Close the connection of client c, if it has one.
+ */
+void close_client(struct client *c) {
+    if (c->fd != -1) {
+        close(c->fd);   // also removes it from the epoll instance
+        c->fd = -1;
+    }
+}
+
+/*
+ * Read what the server sent to client c and answer every complete message.
+ * Return 0 if the connection stays open, -1 if it has to be closed.
+ */
+int read_client(struct shard *s, struct client *c) {
+    int nbytes = read(c->fd, c->buf + c->inbuf, BUFSIZE - 1 - c->inbuf);
+    if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (nbytes <= 0) {
+        if (c->seated == 1) {
+            s->games++;
+        }
+        return -1;
+    }
+    c->inbuf += nbytes;
+
+    // text messages end with \0, frames carry their own length
+    int start = 0;
+    while (start < c->inbuf) {
+        int end;
+        if (c->binary == 0) {
+            char *nul = memchr(c->buf + start, '\0', c->inbuf - start);
+            if (nul == NULL) {
+                break;
+            }
+            end = nul - c->buf + 1;
+            if (read_text(s, c, c->buf + start) == -1) {
+                return -1;
+            }
+        } else {
+            if (c->inbuf - start < FRAME_HEADER) {
+                break;
+            }
+            unsigned char *header = (unsigned char *)c->buf + start;
+            int len = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+            if (len > BUFSIZE - 1 - FRAME_HEADER) {
+                fprintf(stderr, "%s: frame too long\n", c->name);
+                return -1;
+            }
+            if (c->inbuf - start < FRAME_HEADER + len) {
+                break;
+            }
+            end = start + FRAME_HEADER + len;
+            if (read_frame(s, c, header[4], header + FRAME_HEADER, len) == -1) {
+                return -1;
+            }
+        }
+        start = end;
+    }
+
+    c->inbuf -= start;
+    memmove(c->buf, c->buf + start, c->inbuf);
+    if (c->inbuf == BUFSIZE - 1) {
+        fprintf(stderr, "%s: message too long\n", c->name);
+        return -1;
+    }
+    if (churn == 1 && c->seated == 1) {
+        return -1;  // hang up and come back under a new name
+    }
+    return 0;
+}
+
+/*
+ * Answer the \0 terminated text message msg sent to client c.
+ * Return 0 if the connection stays open, -1 if it has to be closed.
+ */
+int read_text(struct shard *s, struct client *c, char *msg) {
+    char line[MAXMESSAGE + 3];
+
+    if (strncmp(msg, "Welcome", 7) == 0) {
+        if (burst == 1) {
+            s->last_welcome = now();
+            s->welcomed++;
+            add_latency(s, s->last_welcome - c->connected);
+            return 0;
+        }
+        if (c->watcher == 1) {
+            return send_all(c, "/watch\r\n", 8);
+        }
+        if (binary == 1) {
+            c->binary = 1;  // everything after this message comes as frames
+            return send_all(c, "/binary\r\n", 9);
+        }
+        int len = snprintf(line, sizeof(line), "%s\r\n", c->name);
+        return send_all(c, line, len);
+    } else if (strncmp(msg, "Your move?", 10) == 0) {
+        send_move(s, c);
+    } else if (strncmp(msg, "Invalid pit", 11) == 0) {
+        s->invalid_pits++;
+        send_move(s, c);
+    } else if (strncmp(msg, "No such game", 12) == 0) {
+        return -1;  // the games are not there yet, try again
+    } else if (c->watcher == 1) {
+        s->views += (strncmp(msg, "Game ", 5) == 0 && strstr(msg, "[end pit]") != NULL);  // not the end notice
+    } else if (strncmp(msg, "Invalid username", 16) == 0) {
+        s->invalid_names++;
+        return -1;
+    } else if (strstr(msg, "[end pit]") != NULL) {
+        read_board(s, c, msg);
+    }
+    return 0;
+}
+
+/*
+ * Answer the frame of type with len bytes of payload sent to client c.
+ * Return 0 if the connection stays open, -1 if it has to be closed.
+ */
+int read_frame(struct shard *s, struct client *c, int type, unsigned char *payload, int len) {
+    switch (type) {
+        case FRAME_WELCOME:
+            return send_frame(c, FRAME_NAME, c->name, strlen(c->name));
+        case FRAME_MOVE:
+            send_move(s, c);
+            break;
+        case FRAME_INVALID_PIT:
+            s->invalid_pits++;
+            send_move(s, c);
+            break;
+        case FRAME_INVALID_NAME:
+            s->invalid_names++;
+            return -1;
+        case FRAME_STATE:
+            read_state(s, c, payload, len);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Take the pits of client c from a FRAME_STATE payload.
+ */
+void read_state(struct shard *s, struct client *c, unsigned char *payload, int len) {
+    unsigned int seq, rows, npits, v;
+    int pos = 0, n;
+    int namelen = strlen(c->name);
+
+    if ((n = get_varint(payload, len, &seq)) == -1) {
+        return;
+    }
+    pos += n;
+    if ((n = get_varint(payload + pos, len - pos, &rows)) == -1) {
+        return;
+    }
+    pos += n;
+    if ((n = get_varint(payload + pos, len - pos, &npits)) == -1 || npits < 1 || npits > MAXPITS) {
+        return;
+    }
+    pos += n;
+    for (unsigned int r = 0; r < rows; r++) {
+        int pits[MAXPITS + 1];
+        for (unsigned int i = 0; i <= npits; i++) {
+            if ((n = get_varint(payload + pos, len - pos, &v)) == -1) {
+                return;
+            }
+            pits[i] = v;
+            pos += n;
+        }
+        if ((n = get_varint(payload + pos, len - pos, &v)) == -1 || pos + n + (int)v > len) {
+            return;
+        }
+        pos += n;
+        if ((int)v == namelen && memcmp(payload + pos, c->name, namelen) == 0) {
+            memcpy(c->pits, pits, sizeof(int) * npits);
+            c->npits = npits;
+            got_state(s, c);
+            return;
+        }
+        pos += v;
+    }
+}
+
+/*
+ * Take the pits of client c from the text board, one "name: [0]4 ... [end pit]0" line per player.
+ */
+void read_board(struct shard *s, struct client *c, char *board) {
+    int namelen = strlen(c->name);
+
+    for (char *line = board; line != NULL && *line != '\0'; ) {
+        if (strncmp(line, c->name, namelen) == 0 && line[namelen] == ':') {
+            char *pos = line + namelen + 1;
+            int npits = 0;
+            while ((pos = strstr(pos, " [")) != NULL && isdigit((unsigned char)pos[2]) && npits < MAXPITS) {
+                pos = strchr(pos, ']');
+                c->pits[npits++] = strtol(pos + 1, &pos, 10);
+            }
+            if (npits == 0) {
+                return;
+            }
+            c->npits = npits;
+            got_state(s, c);
+            return;
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) {
+            line++;
+        }
+    }
+}
+
+/*
+ * Count a game state listing client c, the answer to its move if one is pending.
+ */
+void got_state(struct shard *s, struct client *c) {
+    double t = now();
+    if (c->seated == 0) {
+        c->seated = 1;
+        s->handshakes++;
+    }
+    if (c->moved == 0) {
+        return;
+    }
+
+    add_latency(s, t - c->moved);
+    s->moves++;
+    c->moved = 0;
+}
+
+void add_latency(struct shard *s, double latency) {
+    if (s->nlatency == s->latcap) {
+        s->latcap = (s->latcap == 0) ? 65536 : s->latcap * 2;
+        if ((s->latency = realloc(s->latency, sizeof(double) * s->latcap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->latency[s->nlatency++] = latency;
+}
+
+/*
+ * Play a random pit of client c that holds pebbles.
+ */
+void send_move(struct shard *s, struct client *c) {
+    int nonempty[MAXPITS], n = 0;
+    for (int i = 0; i < c->npits; i++) {
+        if (c->pits[i] > 0) {
+            nonempty[n++] = i;
+        }
+    }
+    int pit = (n > 0) ? nonempty[rand_r(&s->seed) % n] : 0;
+
+    c->moved = now();
+    if (c->binary == 1) {
+        char varint = pit;  // a pit index fits in one byte
+        send_frame(c, FRAME_MOVE, &varint, 1);
+    } else {
+        char line[16];
+        int len = snprintf(line, sizeof(line), "%d\r\n", pit);
+        send_all(c, line, len);
+    }
+}
+
+/*
+ * Write len bytes of buf to client c. The messages are small, so a full
+ * socket buffer means the server stopped reading.
+ * Return 0 on success, -1 otherwise.
+ */
+int send_all(struct client *c, const char *buf, int len) {
+    if (write(c->fd, buf, len) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write a frame of type with len bytes of payload to client c.
+ * Return 0 on success, -1 otherwise.
+ */
+int send_frame(struct client *c, int type, const char *payload, int len) {
+    char frame[FRAME_HEADER + MAXMESSAGE];
+    frame[0] = (len >> 24) & 0xff;
+    frame[1] = (len >> 16) & 0xff;
+    frame[2] = (len >> 8) & 0xff;
+    frame[3] = len & 0xff;
+    frame[4] = type;
+    memcpy(frame + FRAME_HEADER, payload, len);
+    return send_all(c, frame, FRAME_HEADER + len);
+}
+
+/*
+ * Read a varint from the n bytes at buf into v.
+ * Return the number of bytes read, or -1 if buf holds no complete varint.
+ */
+int get_varint(const unsigned char *buf, int n, unsigned int *v) {
+    *v = 0;
+    for (int i = 0; i < n && i < 5; i++) {
+        *v |= (unsigned int)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Add up the counters of all shards and print them with the latency percentiles.
+ */
+void report(struct shard *shards, double elapsed, double running) {
+    long connects = 0, handshakes = 0, invalid_names = 0, invalid_pits = 0, moves = 0, games = 0, nlatency = 0;
+    long welcomed = 0, failed = 0, views = 0;
+    double last_welcome = started;
+    for (int i = 0; i < nthreads; i++) {
+        welcomed += shards[i].welcomed;
+        failed += shards[i].failed;
+        if (shards[i].last_welcome > last_welcome) {
+            last_welcome = shards[i].last_welcome;
+        }
+        connects += shards[i].connects;
+        handshakes += shards[i].handshakes;
+        invalid_names += shards[i].invalid_names;
+        invalid_pits += shards[i].invalid_pits;
+        moves += shards[i].moves;
+        games += shards[i].games;
+        views += shards[i].views;
+        nlatency += shards[i].nlatency;
+    }
+
+    double *latency = malloc(sizeof(double) * (nlatency + 1));
+    if (latency == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long n = 0;
+    for (int i = 0; i < nthreads; i++) {
+        memcpy(latency + n, shards[i].latency, sizeof(double) * shards[i].nlatency);
+        n += shards[i].nlatency;
+        free(shards[i].latency);
+        free(shards[i].clients);
+    }
+    qsort(latency, n, sizeof(double), compare_latency);
+
+    if (burst == 1) {
+        double span = last_welcome - started;
+        printf("burst         %d connections on %d thread(s)\n", nclients, nthreads);
+        printf("welcomed      %ld in %.3f s (%.0f/s)\n", welcomed, span, (span > 0) ? welcomed / span : 0);
+        printf("failed        %ld\n", failed);
+        if (n > 0) {
+            printf("welcome after p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+                   latency[n / 2] * 1e6, latency[n * 99 / 100] * 1e6,
+                   latency[n * 999 / 1000] * 1e6, latency[n - 1] * 1e6);
+        }
+        free(latency);
+        return;
+    }
+
+    printf("protocol      %s\n", binary ? "binary" : "text");
+    printf("clients       %d on %d thread(s) for %.1f s\n", nclients, nthreads, elapsed);
+    printf("connects      %ld (%.0f/s)\n", connects, connects / running);
+    printf("handshakes    %ld (%.0f/s)\n", handshakes, handshakes / running);
+    printf("games over    %ld\n", games);
+    printf("invalid names %ld\n", invalid_names);
+    printf("invalid pits  %ld\n", invalid_pits);
+    printf("moves         %ld (%.0f/s)\n", moves, moves / running);
+    if (nwatchers > 0) {
+        printf("spectators    %d, %ld views (%.0f/s)\n", nwatchers, views, views / running);
+    }
+    if (n > 0) {
+        printf("turn latency  p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+               latency[n / 2] * 1e6, latency[n * 99 / 100] * 1e6,
+               latency[n * 999 / 1000] * 1e6, latency[n - 1] * 1e6);
+    }
+    free(latency);
+}
+
+/*
+ * Connect to the admin port of the server and send the request.
+ * Return the connected fd, or -1 on error.
+ */
+int connect_admin() {
+    struct sockaddr_in admin = server;
+    admin.sin_port = htons(admin_port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&admin, sizeof(admin)) == -1
+        || write(fd, request, strlen(request)) != (int)strlen(request)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read the stats of the server into values, 0 for those it does not have.
+ * Return 0 on success, -1 if the admin port does not answer.
+ */
+int scrape(double *values) {
+    static char reply[STATSIZE];
+    int fd = connect_admin();
+    if (fd == -1) {
+        return -1;
+    }
+    int len = 0, nbytes;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (len < STATSIZE - 1 && poll(&pfd, 1, 2000) == 1
+           && (nbytes = read(fd, reply + len, STATSIZE - 1 - len)) > 0) {
+        len += nbytes;
+    }
+    close(fd);
+    reply[len] = '\0';
+    if (strncmp(reply, "HTTP/1.0 200", 12) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < NSERVER; i++) {
+        char *line = strstr(reply, server_names[i]);
+        values[i] = (line == NULL) ? 0 : strtod(line + strlen(server_names[i]), NULL);
+    }
+    return 0;
+}
+
+/*
+ * Ask for the stats and reset the connection before the reply is read.
+ */
+void hang_up_scrape() {
+    int fd = connect_admin();
+    if (fd != -1) {
+        struct linger reset = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+    }
+}
+
+/*
+ * Print the work of the server during the run, from the stats scraped before and after.
+ */
+void report_server(double *before, double *after) {
+    double d[NSERVER];
+    for (int i = 0; i < NSERVER; i++) {
+        d[i] = after[i] - before[i];
+    }
+    double moves = (d[SRV_MOVES] > 0) ? d[SRV_MOVES] : 1;
+    double loops = (d[SRV_LOOPS] > 0) ? d[SRV_LOOPS] : 1;
+    printf("server        %.2f syscalls/move  %.2f loops/move  %.1f us/loop  %.0f bytes out/move\n",
+           d[SRV_SYSCALLS] / moves, d[SRV_LOOPS] / moves, d[SRV_LOOP_SECONDS] / loops * 1e6,
+           d[SRV_BYTES_OUT] / moves);
+    printf("              %.0f bytes formatted/move  %.1f us flush/move\n",
+           d[SRV_BYTES_FORMATTED] / moves, d[SRV_FLUSH_SECONDS] / moves * 1e6);
+    printf("              %.0f allocations  resident %.1f MB before, %.1f MB after\n",
+           d[SRV_ALLOCATIONS], before[SRV_RESIDENT] / 1048576, after[SRV_RESIDENT] / 1048576);
+}
+
+/*
+ * Open n connections to the server that stay idle until they are closed,
+ * each one welcomed before the next, and return their fds. They never send
+ * a name, so the server has to run without a name timeout (-n 0) to keep them.
+ */
+int *open_idle(int n) {
+    int *fds = malloc(sizeof(int) * (n + 1));
+    if (fds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        if ((fds[i] = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            exit(1);
+        }
+        if (connect(fds[i], (struct sockaddr *)&server, sizeof(server)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+        char welcome[MAXMESSAGE];
+        if (read(fds[i], welcome, sizeof(welcome)) <= 0) {  // accepted once welcomed
+            fprintf(stderr, "idle connection %d: closed by the server\n", i);
+            exit(1);
+        }
+    }
+    return fds;
+}
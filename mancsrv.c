@@ -1,17 +1,61 @@
+#define _GNU_SOURCE /* accept4 */
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef USE_SELECT
+#include <sys/select.h>
+#else
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define MAXNAME 80  /* maximum permitted name size, not including \0 */
-#define NPITS 6  /* number of pits on a side, not including the end pit */
-#define NPEBBLES 4 /* initial number of pebbles per pit */
+#define NPITS 6  /* default number of pits on a side, not including the end pit */
+#define NPEBBLES 4 /* default initial number of pebbles per pit */
+#define MAXPITS 16  /* most pits on a side of any game */
+#define MAXPEBBLES 100  /* most initial pebbles per pit of any game */
+#define PITINDEX ((MAXPITS > 10) ? 2 : 1)  /* digits of the largest pit index */
+/* most bytes of a board line of npits pits: "name:", " [i]n" pits, " [end pit]n\r\n" */
+#define BOARDLINE(npits) (MAXNAME + 1 + (npits) * (3 + PITINDEX + 11) + 10 + 11 + 2)
 #define MAXMESSAGE (MAXNAME + 50) /* maximum permitted message size */
+#define MAXEVENTS 256 /* maximum number of events handled per epoll_wait */
+#define MAXQUEUE 65536 /* default maximum bytes queued for a client before it is dropped */
+#define MAXIOV 64   /* maximum number of queued messages sent by one sendmsg */
+#define URINGSIZE 4096  /* submission queue entries of the io_uring of a shard, a power of two */
+#define URINGBUFS 1024  /* input buffers provided to the io_uring of a shard, a power of two */
+#define URINGBUFSIZE 512    /* bytes of each input buffer */
+#define SLABSIZE 64 /* number of player structs allocated at once by alloc_player */
+#define NBUCKETS 24 /* latency histogram buckets, bucket i counts durations under 2^(i+8) ns */
+#define LOGSIZE 4096    /* number of log records buffered per shard, a power of two */
+#define WHEELBITS 8 /* each level of the timer wheel has 2^WHEELBITS slots */
+#define WHEELSIZE (1 << WHEELBITS)
+#define TICK_NS 10000000LL  /* resolution of the timer wheel, 10ms */
+#define VIEWBATCH 64  /* maximum number of spectators flushed per loop iteration */
+#define BOTDEPTH 64 /* deepest search of a bot move, in plies */
+#define BOT_INF (1 << 30)   /* beyond any score of a board */
+#define BENCHMOVES 1000 /* most moves played by the bot benchmark */
+#define BENCHLOOKUPS 2000000    /* players compared per table size by the lookup benchmark */
+#define BENCHSOWS 20000000      /* pebbles sown per board by the sowing benchmark */
+#define BATCHROWS 4096  /* games per block of the batch simulator output */
+#define BATCHMAXMOVES 100000    /* a simulated game still going after this many moves is stopped */
+#define JOURNALBATCH 1024   /* journal records buffered per shard before they are written */
 
 #define WELCOME "Welcome to Mancala. What is your name?\r\n"
 #define WELCOME_SIZE (strlen(WELCOME) + 1)
@@ -23,606 +67,5153 @@
 #define NOT_MOVE_SIZE (strlen(NOT_MOVE) + 1)
 #define INVALID_PIT "Invalid pit index! Try again.\r\n"
 #define INVALID_PIT_SIZE (strlen(INVALID_PIT) + 1)
+#define UNKNOWN_COMMAND "Unknown command.\r\n"
+#define UNKNOWN_COMMAND_SIZE (strlen(UNKNOWN_COMMAND) + 1)
+#define TIMEOUT "Time is up, you lose your turn.\r\n"
+#define TIMEOUT_SIZE (strlen(TIMEOUT) + 1)
+#define NO_GAME "No such game to watch.\r\n"
+#define NO_GAME_SIZE (strlen(NO_GAME) + 1)
+#define WATCH "/watch"  /* sent instead of a name: /watch to watch the newest game, /watch id for game id */
+#define BOARD "/board"  /* sent before the name: /board PxE to play on P pits per side of E pebbles */
+#define INVALID_BOARD "Invalid board, send /board PITSxPEBBLES.\r\n"
+#define INVALID_BOARD_SIZE (strlen(INVALID_BOARD) + 1)
+
+/*
+ * Frames of the binary protocol, which a client asks for by sending the line
+ * /binary after WELCOME: a fixed header of the payload length (4 bytes, big
+ * endian) and the frame type (1 byte), then the payload. Integers in a payload
+ * are varints, 7 bits per byte, least significant first.
+ */
+#define BINARY "/binary"
+#define FRAME_HEADER 5
+#define FRAME_TEXT 1    /* server: any other message, as text without the trailing \0 */
+#define FRAME_WELCOME 2 /* server: binary protocol on, what is your name? */
+#define FRAME_NAME 3    /* client: the username */
+#define FRAME_MOVE 4    /* server: your move?  client: the pit index as a varint */
+#define FRAME_NOT_MOVE 5    /* server: it is not your move */
+#define FRAME_INVALID_PIT 6 /* server: invalid pit index, try again */
+#define FRAME_INVALID_NAME 7    /* server: invalid username, disconnected */
+#define FRAME_STATE 8   /* server: seq, number of rows, pits per side, then per row the pits and the end pit, name length, name */
 
 #define REQUIRE_CONNECT "New player requires connection.\n"
 #define INVALID_NAME_DISCONNECT "Disconnect a player due to invalid name.\n"
 
 int port = 3000;
-int listenfd;
+int max_queue = MAXQUEUE;  /* -q: drop a client whose unsent output exceeds this */
+int max_seats = 0;  /* -s: maximum number of players in one game, 0 for no limit */
+int nthreads = 1;   /* -t: number of shards, each runs its own listener and event loop */
+int use_uring = 0;  /* -u: do the socket I/O through io_uring instead of epoll and read/sendmsg */
+int admin_port = 0; /* -a: loopback port serving the stats, 0 for none */
+int log_level = 0;  /* -l: records below this level are not logged */
+int name_timeout = 60;  /* -n: seconds a new client has to send its name, 0 for no limit */
+int move_timeout = 120; /* -m: seconds a player has to move before the turn is skipped, 0 for no limit */
+int write_timeout = 30; /* -w: seconds a client may leave output unread before it is dropped, 0 for no limit */
+int backlog = SOMAXCONN;    /* -b: length of the queue of pending connections of each listener */
+char *snapshot_path = NULL; /* -f: file the games are saved to and restored from, NULL for none */
+int snapshot_interval = 5;  /* -i: seconds between two snapshots */
+char *journal_path = NULL;  /* -j: file every change of a board is appended to, NULL for none */
+char *replay_path = NULL;   /* -r: replay this journal instead of serving */
+int replay_game = 0;    /* -g: id of the game whose boards the replay prints, 0 for none */
+int view_interval = 100;    /* -v: milliseconds between two views sent to spectators, 0 for every change */
+int bot_players = 0;    /* -B: bots take the empty seats of a game with fewer players, 0 for no bots */
+int bot_ms = 100;   /* -k: milliseconds a bot searches for its move */
+int bot_threads = 0;    /* -K: threads searching the bot moves, 0 for one per CPU */
+int default_pits = NPITS;   /* -G: board of the games of players who did not send /board */
+int default_pebbles = NPEBBLES;
+int bench_players = 0;  /* -e: benchmark the bot search on a game of this many bots instead of serving */
+int bench_lookup = 0;   /* -e lookup: benchmark the fd and name lookups instead of serving */
+int bench_sow = 0;      /* -e sow: benchmark turn_game() on long laps instead of serving */
+long batch_games = 0;   /* -S: simulate this many games instead of serving, 0 to serve */
+int batch_join = -1;    /* -J: the last player of a simulated game joins after this many moves, -1 for none */
+int batch_policy = 0;   /* -y: how simulated players choose their pit */
+char *batch_path = NULL;    /* -o: file the columns of the simulated games are written to, NULL for none */
+int batch_players = 2;  /* players per simulated game, -s if not 0 */
+FILE *batch_out = NULL;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;    /* one block of batch_out at a time */
+
+/*
+ * Every __thread variable below is the state of one shard. A shard owns its
+ * connections and games, so they are never touched by another thread.
+ */
+__thread int listenfd;
+__thread int reserve_fd = -1;   /* kept open to accept and shed a connection when out of fds */
+
+#ifdef USE_SELECT
+__thread fd_set all_fds;  /* fds watched by select, built with -DUSE_SELECT */
+__thread int max_fd;
+#else
+__thread int epfd;   /* the epoll instance, each event carries its struct player */
+
+/*
+ * With -u the shard does its socket I/O through its own io_uring: one
+ * multishot accept on listenfd, one multishot recv per client filling the
+ * provided buffers, and one sendmsg in flight per client. The requests
+ * queued during a loop iteration are submitted together by the
+ * io_uring_enter that waits for the next completions.
+ * The kind of a request is in the low bits of its user_data: a recv carries
+ * the fd and serial of its connection, a send its struct uring_send.
+ */
+enum { URING_ACCEPT, URING_RECV, URING_SEND, URING_CLOSE };
+
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_array;
+    unsigned int *cq_head, *cq_tail;
+    unsigned int sq_mask, cq_mask, sq_entries;
+    unsigned int tail;  /* submission queue tail, published before each io_uring_enter */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufs;    /* ring of the free input buffers */
+    char *data; /* the input buffers, URINGBUFS of URINGBUFSIZE bytes */
+    unsigned short buftail;
+    char *input;    /* input of the recv being dispatched, taken by read_from() */
+    int inlen;
+    int eof;    /* set to 1 if the recv being dispatched ended the connection */
+    struct uring_send *freesends;  /* completed sends kept for reuse */
+};
+
+/*
+ * A sendmsg in flight, it keeps a reference to each message it sends
+ * until it completes, even if its player is closed meanwhile.
+ */
+struct uring_send {
+    struct player *player;
+    struct msghdr msg;
+    struct iovec iov[MAXIOV];
+    struct message *msgs[MAXIOV];
+    int nmsgs;
+    struct uring_send *next_free;
+};
+
+__thread struct uring uring;
+#endif
+
+/*
+ * An immutable message, formatted once and shared by the output queues
+ * of all its recipients, freed when the last reference is released.
+ */
+struct message {
+    int refcount;
+    int len;
+    struct message *frame;  /* the same message for binary clients, built on first use */
+    char data[];
+};
+
+__thread struct message *welcome_msg, *invalid_msg, *move_msg, *not_move_msg, *invalid_pit_msg,
+                       *unknown_command_msg, *timeout_msg, *no_game_msg, *invalid_board_msg;
+
+/*
+ * A deadline in the timer wheel of the shard, owner is the struct player
+ * or struct game it belongs to. Embedded in its owner, never allocated.
+ */
+enum { TIMER_NAME, TIMER_MOVE, TIMER_WRITE, TIMER_SNAPSHOT, TIMER_VIEW, TIMER_BOT };
+
+struct timer {
+    long long expires;  /* tick at which the timer fires */
+    int kind;
+    void *owner;
+    struct timer *next;
+    struct timer **pprev;   /* the pointer to this timer in its slot, NULL if not pending */
+};
+
+/*
+ * Two-level timer wheel: level 0 has one slot per tick, level 1 one slot
+ * per WHEELSIZE ticks, cascaded into level 0 as its time comes. Timers
+ * further out than both levels wait in the last slot of level 1.
+ */
+__thread struct timer *wheel[2][WHEELSIZE];
+__thread long long wheel_tick;  /* the last tick whose timers were run */
+__thread int ntimers = 0;   /* number of pending timers */
 
 struct player {
     int fd;
     char name[MAXNAME+1];
-    int pits[NPITS+1];
+    int *pits;  /* this player's row in game->board, game->npits pits then the end pit */
+    int seat;   /* index of the row in game->board */
     struct player *front;
     struct player *next;
-    struct player *head;
+    struct game *game;  /* the game this player is seated in, NULL while in the lobby */
 
     int wait_for_username;  /* set to 1 if accepted but waiting to check username, 0 if successfully add to game */
-    char name_buf[MAXNAME+1]; /* store the name from the client, need to check the validity */
-    int get_full_name;  /* set to 1 if get the full name, 0 otherwise */
-    int inbuf;  /* number of bytes already read */
+    char buf[MAXMESSAGE+1]; /* bytes from the client not yet consumed as a line (name or pit index) */
+    int inbuf;  /* number of bytes currently in buf */
+    int skip_lf;    /* set to 1 if the last line ended with \r, so a leading \n belongs to it */
+
+    struct message **outq;  /* ring of messages queued for the client but not yet sent */
+    int outhead;    /* index of the first queued message in outq */
+    int outcount;   /* number of messages in outq */
+    int outcap; /* allocated length of outq */
+    int outoff; /* bytes of the first queued message already sent */
+    int outlen; /* total number of bytes queued */
+    int lagging;    /* set to 1 if outlen exceeded max_queue, the client will be dropped */
+    struct uring_send *sendop;  /* with -u, the sendmsg of the first queued messages in flight */
+    unsigned int serial;    /* tells the completions of this connection from those of an earlier one */
+    int dirty;  /* set to 1 if in the dirtylist */
+    struct player *next_dirty;
+    struct player *next_free;   /* next in closedlist or freeplayers */
 
-    int play;   /* set to 1 if it is this player's turn to play, 0 otherwise */
+    int nonempty;   /* number of pits with pebbles, not including the end pit */
+    int delta;  /* set to 1 if the client asked for the game state as snapshot and deltas */
+    int binary; /* set to 1 if the client speaks the binary protocol */
     int disconnect; /* set to 1 if disconnect to the server, 0 if connect to the server */
+    int watching;   /* set to 1 if a spectator of game, linked in its watchers instead of playerlist */
+    int stale;  /* set to 1 if a spectator missed the last view, sent once its output is drained */
+    int follow; /* set to 1 if a spectator moves on to the newest game when its game ends */
+    int bot;    /* set to 1 if played by the server, a bot has no connection (fd -1) */
+    int npits;  /* board this player is seated on, as asked with /board */
+    int npebbles;
+    struct timer name_timer;    /* deadline for the username, or for a restored seat to be taken back */
+    struct timer write_timer;   /* deadline for the client to read the queued output */
+};
+
+/*
+ * One table of Mancala, the players seated in it take turns in order.
+ */
+struct game {
+    int id;
+    struct player *playerlist;  /* players seated in this game, newest first */
+    struct player *current; /* the player who plays the current turn, NULL if nobody is seated */
+    int nplayers;   /* number of players in playerlist */
+    int nempty; /* number of players whose pits are all empty, the game is over if not 0 */
+    int npits;  /* pits on a side, not including the end pit */
+    int npebbles;   /* pebbles per pit of the first player */
+    int *board; /* pits of all seated players, one row of npits+1 per seat */
+    struct player **seats;  /* player of each row, rows are in reverse playerlist order */
+    int boardcap;   /* allocated number of rows */
+    int seq;    /* sequence number of the last game state sent */
+    int *sent;  /* board as of the last game state sent, the deltas are computed against it */
+    int resync; /* set to 1 if rows were added or removed since the last game state sent */
+    struct game *front;
+    struct game *next;  /* next in gamelist, or in freegames once finished */
+    int open;   /* set to 1 if in openlist */
+    struct game *front_open;
+    struct game *next_open;
+    struct timer move_timer;    /* deadline for the current player to move */
+    struct player *clock;   /* the player move_timer runs for */
+    struct player *watchers;    /* spectators of this game */
+    int nwatchers;  /* number of players in watchers */
+    struct message *view;   /* the last board sent to the spectators, shared by all of them */
+    int viewed; /* set to 1 if in the viewlist */
+    struct game *next_viewed;
+    struct bot_job *job;    /* the search for the move of the current player if it is a bot */
+    struct timer bot_timer; /* when the bot plays the best move found by job */
+};
+
+__thread struct player *lobby = NULL;    /* connected players still choosing a name */
+__thread struct game *gamelist = NULL;   /* games being played */
+__thread struct game *openlist = NULL;   /* games that may still have a free seat */
+__thread struct game *freegames = NULL;  /* finished games kept for reuse */
+__thread struct player *dirtylist = NULL;    /* players with output to flush at the end of this loop iteration */
+#ifdef USE_SELECT
+__thread struct player *blockedlist = NULL;  /* players whose output waits for the socket to be writable */
+#endif
+__thread struct game *viewlist = NULL;   /* watched games whose board changed since the last views */
+__thread struct timer view_timer;   /* pending until the next views may be sent */
+__thread struct player *idlewatchers = NULL;   /* spectators following the newest game while there is none */
+__thread struct player *watchdirty = NULL;  /* spectators with output to flush, oldest first */
+__thread struct player *watchtail = NULL;
+__thread struct player *closedlist = NULL;   /* players closed in this loop iteration */
+__thread struct player *freeplayers = NULL;  /* pool of player structs ready for reuse */
+__thread struct player **conns = NULL;  /* open connections of this shard indexed by fd */
+__thread int nconns = 0;    /* allocated length of conns */
+__thread unsigned int next_serial = 0;  /* serial of the last connection accepted */
+__thread struct player **names = NULL;  /* open-addressing set of the seated players of this shard, keyed by name */
+__thread int nnames = 0;    /* number of players in names */
+__thread int namecap = 0;   /* allocated length of names, a power of two */
+int next_game_id = 1;   /* shared by all shards, only changed atomically */
+
+/*
+ * Counters and stage latencies of one shard. Only the shard writes them, with
+ * plain relaxed stores, the admin thread reads them to add up all shards.
+ */
+enum { ACCEPTS, HANDSHAKES, INVALID_NAMES, INVALID_PITS, MOVES, BYTES_IN, BYTES_OUT, BYTES_FORMATTED,
+       SYSCALLS, LOOPS, LOG_DROPS, TIMEOUTS, REFUSED, VIEWS, CONFLATED, BOT_MOVES, BOT_NODES,
+       ALLOCATIONS, NCOUNTERS };
+const char *counter_names[NCOUNTERS] = { "accepts", "handshakes", "invalid_names", "invalid_pits",
+                                         "moves", "bytes_in", "bytes_out", "bytes_formatted", "syscalls", "loops",
+                                         "log_drops", "timeouts", "refused", "views", "conflated",
+                                         "bot_moves", "bot_nodes", "allocations" };
+enum { STAGE_LOOP, STAGE_READ, STAGE_TURN, STAGE_DISPLAY, STAGE_BROADCAST, STAGE_FLUSH, STAGE_VIEWS, NSTAGES };
+const char *stage_names[NSTAGES] = { "loop", "read", "turn_game", "display_game_state", "broadcast", "flush",
+                                     "views" };
+
+struct stats {
+    long count[NCOUNTERS];
+    long hist[NSTAGES][NBUCKETS];
+    long time_ns[NSTAGES];  /* total time spent in each stage */
+};
+
+struct stats *allstats; /* one per shard, allocated before the shards start */
+int nstats = 0; /* number of shards that took their stats, only changed atomically */
+__thread struct stats *stats;   /* the stats of this shard */
+
+/*
+ * The event loop never writes to stdout itself. It puts fixed-size records
+ * into the log ring of its shard, the logger thread formats and writes them.
+ * A record that finds the ring full is dropped and counted in LOG_DROPS.
+ */
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_OFF };
+const char *level_names[] = { "debug", "info", "warn", "off" };
+enum { POLICY_RANDOM, POLICY_EXTRA, NPOLICIES };
+const char *policy_names[] = { "random", "extra" };
+enum { EV_CONNECT, EV_INVALID_NAME, EV_JOIN, EV_MOVE, EV_TURN, EV_BOARD, EV_DISCONNECT,
+       EV_BEHIND, EV_GAME_START, EV_GAME_OVER, EV_POINTS, EV_GAME_END, EV_NAME_TIMEOUT,
+       EV_MOVE_TIMEOUT, EV_WRITE_TIMEOUT, EV_REFUSED, EV_REJOIN, EV_RESTORE, EV_SNAPSHOT_ERROR,
+       EV_JOURNAL_ERROR, EV_WATCH };
+
+struct log_record {
+    int event;
+    int game;   /* id of the game, 0 if none */
+    int a, b;   /* pebbles and pit of EV_MOVE, points of EV_POINTS, pits on a side of EV_BOARD */
+    int pits[MAXPITS + 1];  /* the row of EV_BOARD */
+    char name[MAXNAME + 1];
+};
+
+/*
+ * Single-producer single-consumer ring: the shard only moves head, the
+ * logger thread only moves tail, each on its own cache line.
+ */
+struct log_ring {
+    struct log_record *records;
+    unsigned int head __attribute__((aligned(64)));    /* next record to write */
+    unsigned int tail __attribute__((aligned(64)));    /* next record to format */
+};
+
+struct log_ring *alllogs;   /* one per shard, allocated before the shards start */
+__thread struct log_ring *logs; /* the log ring of this shard */
+
+/*
+ * Snapshot file of a shard, all integers in host byte order:
+ * a struct snapshot_header, then for each game a struct snapshot_game
+ * followed by its nplayers struct snapshot_seat in playerlist order.
+ * A restored seat waits for its player under a struct player without
+ * a connection (fd -1) until a client sends the same name, a bot seat
+ * plays again right away.
+ */
+#define SNAPSHOT_MAGIC 0x434e414d   /* "MANC" */
+#define SNAPSHOT_VERSION 3
+
+struct snapshot_header {
+    int magic;
+    int version;
+    int npits;
+    int maxname;
+    int ngames;
+};
+
+struct snapshot_game {
+    int npits;
+    int npebbles;
+    int nplayers;
+    int current;    /* index of the current player in playerlist order, -1 if none */
+};
+
+struct snapshot_seat {
+    int pits[MAXPITS + 1];  /* npits of the game, then the end pit */
+    int bot;    /* set to 1 if the seat is played by a bot */
+    char name[MAXNAME + 1];
+};
+
+/*
+ * A snapshot handed to a writer thread, which frees it once written.
+ */
+struct snapshot_job {
+    char *buf;
+    size_t len;
+    char path[256];
+    int *busy;  /* the snapshot_busy flag of the shard, cleared when done */
+};
+
+__thread char snapshot_file[256];   /* the snapshot file of this shard */
+__thread int snapshot_busy = 0; /* set to 1 while a writer thread saves the last snapshot */
+__thread struct timer snapshot_timer;
+
+/*
+ * Journal file of a shard: fixed-size records in host byte order, only
+ * ever appended. Replaying them in order with the same seat_player(),
+ * turn_game() and disconnect() as the server rebuilds every board.
+ * J_START marks a server start, the games of the earlier run are gone.
+ */
+enum { J_START, J_JOIN, J_MOVE, J_CURRENT, J_PIT, J_LEAVE, J_END };
+
+struct journal_record {
+    int game;   /* id of the game, 0 for J_START */
+    short event;
+    short pit;  /* pit of J_MOVE and J_PIT, pits on a side of J_JOIN */
+    int row;    /* row of the player in game->board */
+    int value;  /* pebbles of J_JOIN, J_MOVE and J_PIT, MAXPITS for J_START */
+};
+
+__thread int journal_fd = -1;
+__thread struct journal_record journal[JOURNALBATCH];  /* records not written yet, group committed */
+__thread int njournal = 0;
+
+/*
+ * A board searched by a bot, laid out like game->board, with the counts
+ * kept by the server: nonempty pits of each row and rows without pebbles.
+ * Moves are applied and undone in place, a search never allocates.
+ */
+struct sim {
+    int nplayers;
+    int npits;
+    int *board;
+    int *nonempty;
+    int nempty;
+    int current;    /* row of the player who plays next */
+};
+
+/*
+ * The search for the move of one bot: iterative deepening, each depth split
+ * into one task per legal pit, run by the bot workers. The shard that made
+ * the job only reads best, sets stop and drops its reference.
+ */
+struct bot_task {
+    struct bot_job *job;
+    int pit;
+    struct bot_task *front;
+    struct bot_task *next;
+};
+
+struct bot_job {
+    int refs;   /* the shard and every queued or running task, freed at 0 */
+    int stop;   /* set to 1 once the move is played */
+    long long deadline; /* now_ns() at which the search gives up */
+    int me; /* row of the bot */
+    int nplayers;
+    int npits;
+    int *board; /* the board when the search started, never changed */
+    struct player *player;  /* the bot, only used by the shard */
+    pthread_mutex_t lock;   /* protects the fields below */
+    int depth;  /* the depth being searched */
+    int pending;    /* tasks of this depth not finished */
+    int alpha;  /* best score found so far at this depth */
+    int cand;   /* pit of alpha */
+    int cutoff; /* set to 1 if the depth limit cut some line short */
+    int best;   /* best pit of the deepest finished depth */
+    int depth_done; /* the deepest finished depth */
+    long nodes;
+    struct bot_task tasks[MAXPITS];
+};
+
+/*
+ * Totals of the games simulated by one batch thread, added up at the end.
+ * Seats are in join order, the first player to join moves first.
+ */
+struct batch_stats {
+    long games;
+    long moves;
+    long extra; /* moves after which the same player plays again */
+    long unfinished;    /* games stopped after BATCHMAXMOVES moves */
+    long draws;
+    int min_moves;
+    int max_moves;
+    long *seated;   /* games each seat was taken in */
+    long *wins;
+    long *points;
+};
+
+/*
+ * Header of each block of batch_out, followed by ncolumns columns of nrows
+ * ints: moves, extra turns, winning seat or -1 for a draw, then the points
+ * of each seat, -1 if it was never taken.
+ */
+struct batch_block {
+    int nrows;
+    int ncolumns;
+};
+
+/*
+ * One search thread: its deque of tasks, taken from the back by itself and
+ * stolen from the front by idle workers, and the board it searches.
+ */
+struct bot_worker {
+    pthread_t tid;
+    int id;
+    pthread_mutex_t lock;   /* protects the deque */
+    struct bot_task *head;
+    struct bot_task *tail;
+    struct sim sim;
+    int cap;    /* rows allocated in sim */
+    struct bot_job *job;    /* job of the running task */
+    long nodes;
+    int aborted;    /* set to 1 once the running task ran out of time */
+    int cutoff;
 };
-struct player *playerlist = NULL;
+
+struct bot_worker *workers; /* allocated before the shards start */
+int nworkers = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+int nqueued = 0;    /* tasks in all deques, protected by pool_lock */
+__thread int next_worker = 0;   /* deque the next job of this shard starts in */
+__thread int nbots = 0; /* bots made by this shard, for their names */
 
 
 extern void parseargs(int argc, char **argv);
 extern void makelistener();
-extern int compute_average_pebbles();
-extern int game_is_over();
-extern void broadcast(char *s, struct player *not_announce);
+extern int compute_average_pebbles(struct game *g);
+extern int game_is_over(struct game *g);
+extern void broadcast(struct game *g, char *s, struct player *not_announce);
 
+void *run_shard(void *arg);
+void init_events();
+void wait_events();
+void watch_fd(int fd, void *data);
+void unwatch_fd(int fd);
+void close_fd(int fd);
+#ifndef USE_SELECT
+void init_uring();
+struct io_uring_sqe *get_sqe();
+int enter_uring(int wait, int timeout);
+void reap_completions();
+void complete_recv(unsigned long long data, int res, unsigned int flags);
+void complete_accept(int res, unsigned int flags);
+void send_output(struct player *p);
+void complete_send(struct uring_send *s, int res);
+void recycle_buffer(int bid);
+#endif
+void process_player(struct player *p);
+void init_messages();
+struct message *new_message(const char *s, int len);
+struct message *new_frame(int type, const char *payload, int len);
+void put_header(char *buf, int type, int len);
+struct message *frame_of(struct message *m);
+int put_varint(char *buf, unsigned int v);
+int get_varint(const char *buf, int n, unsigned int *v);
+void release_message(struct message *m);
+void queue_message(struct player *p, struct message *m);
+void drop_output(struct player *p);
+void broadcast_message(struct game *g, struct message *m, struct player *not_announce);
+void mark_dirty(struct player *p);
+void flush_players();
+void flush_watchers();
+void flush_dirty(struct player *p);
+void flush_output(struct player *p);
+void consume_output(struct player *p, int nbytes);
+void sent_output(struct player *p);
+void close_player(struct player *p);
+void read_name(struct player *p, char *name);
+void read_move(struct player *p, char *read_number);
+void read_command(struct player *p, char *command);
+void read_frame(struct player *p, int type, char *payload, int len);
+void play_move(struct player *p, int potential_index);
+void announce_turn(struct game *g);
+void announce_disconnect(struct player *p);
+struct game *find_game(int npits, int npebbles);
+void open_game(struct game *g);
+void close_game(struct game *g);
+void seat_player(struct player *p, struct game *g);
+void unseat_player(struct player *p);
+void end_game(struct game *g);
+void free_game(struct game *g);
 int accept_connection(int listenfd);
+int refuse_connection(int listenfd, int error);
+void open_connection(int client_fd);
 void reset_pits(struct player *current_player, int pebbles);
 void initialize_player(int client_fd);
+struct player *alloc_player();
+void pool_players();
 int find_newline(const char *buf, int n);
-char *read_from(int fd);
-void display_game_state();
-char *disconnect(int disconnect_fd);
-void disconnect_invalid_name(int fd, fd_set all_fds);
+int read_from(struct player *p);
+int get_line(struct player *p, char *line);
+int get_frame(struct player *p, int *type, char *payload, int *len);
+void display_game_state(struct game *g);
+struct message *snapshot_message(struct game *g);
+struct message *delta_message(struct game *g);
+struct message *state_frame(struct game *g);
+const char *disconnect(struct player *disconnect_player);
+void disconnect_invalid_name(int fd);
+void write_invalid_name(int fd);
 void turn_game(struct player *turn_player, int pit_index);
-int get_number_players();
+void turn_kernel(struct player *turn_player, int pit_index, int npits);
+int sow_pits(struct player *p, int from, int to, int pebbles, int npits);
+int get_number_players(struct game *g);
 struct player *get_player(int fd);
-struct player *get_current_player();
+void add_conn(struct player *p);
+void remove_conn(int fd);
+unsigned int hash_name(const char *name);
+struct player *find_name(const char *name);
+void add_name(struct player *p);
+void remove_name(struct player *p);
+struct player *get_current_player(struct game *g);
 struct player *get_next_player(struct player *current_player);
+void add_count(int counter, long n);
+long long now_ns();
+void add_time(int stage, long long start);
+void *run_admin(void *arg);
+void write_stats(FILE *out);
+long resident_bytes();
+void log_event(int level, int event, struct game *g, const char *name, int a, int b);
+struct log_record *start_record(int level, int event, struct game *g, const char *name);
+void end_record();
+void log_board(struct game *g);
+void *run_logger(void *arg);
+int drain_log(struct log_ring *r, FILE *out);
+void write_record(struct log_record *rec, FILE *out);
+struct game *new_game(int npits, int npebbles);
+void leave_lobby(struct player *p);
+void take_seat(struct player *p, struct player *seat);
+void take_snapshot();
+void *write_snapshot(void *arg);
+void restore_snapshot();
+int check_seats(struct snapshot_seat *seats, int n, int npits);
+void init_timer(struct timer *t, int kind, void *owner);
+void add_timer(struct timer *t, int seconds);
+void add_timer_ms(struct timer *t, long long ms);
+void place_timer(struct timer *t);
+void remove_timer(struct timer *t);
+long long now_tick();
+void run_timers();
+void fire_timer(struct timer *t);
+int next_timeout();
+void set_pit(struct player *p, int pit, int pebbles);
+void journal_file(char *file, int size, int shard);
+void open_journal(int shard);
+void resume_game_ids();
+void journal_event(struct game *g, int event, int row, int pit, int value);
+void flush_journal();
+void replay_journal();
+void print_board(struct game *g);
+int format_board(struct game *g, char *buf);
+void watch_game(struct player *p, int id);
+void choose_board(struct player *p, const char *arg);
+void stop_watching(struct player *p);
+void link_watcher(struct player *p, struct game *g);
+void unlink_watcher(struct player *p);
+void mark_viewed(struct game *g);
+void feed_watchers();
+struct message *view_message(struct game *g);
+int format_status(struct game *g, char *buf);
+struct message *view_frame(struct game *g);
+void release_watchers(struct game *g);
+int fill_seats(struct game *g);
+void seat_bot(struct game *g);
+void think(struct game *g);
+void cancel_job(struct game *g);
+int stop_job(struct bot_job *job, long *nodes);
+struct bot_job *start_job(int *board, int nplayers, int npits, int me);
+void release_job(struct bot_job *job);
+void start_workers();
+void *run_worker(void *arg);
+void push_task(struct bot_worker *w, struct bot_task *t);
+struct bot_task *pop_task(struct bot_worker *w);
+void run_task(struct bot_worker *w, struct bot_task *t);
+void push_depth(struct bot_worker *w, struct bot_job *job);
+int bot_search(struct bot_worker *w, int depth, int alpha, int beta);
+int sim_eval(struct sim *b, int me);
+int sim_move(struct sim *b, int seat, int pit);
+void sim_undo(struct sim *b, int seat, int pit, int pebbles);
+int sim_sow(struct sim *b, int seat, int pit, int pebbles, int d);
+void sim_laps(struct sim *b, int seat, int laps);
+void sim_add(struct sim *b, int row, int pit, int d);
+void sim_load(struct sim *b, const int *board, int nplayers, int npits);
+void run_bench();
+void run_lookup_bench();
+void run_sow_bench();
+void sow_pebbles(struct player *turn_player, int pit_index);
+void run_batch();
+void *run_batch_thread(void *arg);
+void batch_seat(struct game *g);
+int batch_pit(struct player *p, unsigned long long *rng);
+void write_batch(int *columns, int nrows, int ncolumns);
+
+
+int main(int argc, char **argv) {
+    parseargs(argc, argv);
+
+    // a peer that hangs up fails the write with EPIPE instead of killing the server,
+    // set before any thread starts so every thread inherits it
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((allstats = calloc(nthreads, sizeof(struct stats))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if ((alllogs = calloc(nthreads, sizeof(struct log_ring))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if ((alllogs[i].records = malloc(sizeof(struct log_record) * LOGSIZE)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    if (replay_path != NULL) {
+        replay_journal();
+        return 0;
+    }
+    if (batch_games > 0) {
+        run_batch();
+        return 0;
+    }
+    if (bench_lookup == 1) {
+        run_lookup_bench();
+        return 0;
+    }
+    if (bench_sow == 1) {
+        run_sow_bench();
+        return 0;
+    }
+    if (bot_players > 0 || bench_players > 0) {
+        start_workers();
+    }
+    if (bench_players > 0) {
+        run_bench();
+        return 0;
+    }
+    if (journal_path != NULL) {
+        resume_game_ids();
+    }
+    if (log_level < LOG_OFF) {
+        pthread_t tid;
+        if ((errno = pthread_create(&tid, NULL, run_logger, NULL)) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    if (admin_port != 0) {
+        pthread_t tid;
+        if ((errno = pthread_create(&tid, NULL, run_admin, NULL)) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    // the main thread runs the last shard itself
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+        if ((errno = pthread_create(&tid, NULL, run_shard, NULL)) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    run_shard(NULL);
+
+    return 0;
+}
+
+/*
+ * Run one shard: its own listener on the shared port, its own event loop
+ * and the games of the players it accepted.
+ */
+void *run_shard(void *arg) {
+    int shard = __sync_fetch_and_add(&nstats, 1);
+    stats = &allstats[shard];
+    logs = &alllogs[shard];
+    init_messages();
+    makelistener();
+    init_events();
+    wheel_tick = now_tick();
+    init_timer(&view_timer, TIMER_VIEW, NULL);
+    if (journal_path != NULL) {
+        open_journal(shard);    // first, so the restored games are journaled too
+    }
+    if (snapshot_path != NULL) {    // only with one shard, see parseargs()
+        snprintf(snapshot_file, sizeof(snapshot_file), "%s", snapshot_path);
+        restore_snapshot();
+        init_timer(&snapshot_timer, TIMER_SNAPSHOT, NULL);
+        add_timer(&snapshot_timer, snapshot_interval);
+    }
+
+    // games are torn down as they finish, the server keeps listening
+    while (1) {
+        wait_events();
+    }
+
+    return NULL;
+}
+
+/*
+ * Handle the readable event of player p, which is either a potential player
+ * still sending the username or a player already in the game.
+ * The fd is edge-triggered, so keep reading until there is no more input.
+ */
+void process_player(struct player *p) {
+    char line[MAXMESSAGE + 1];
+
+    while (p->disconnect == 0) {
+        int nbytes = read_from(p);
+        if (nbytes == -1) {
+            if (p->wait_for_username == 1) {
+                disconnect_invalid_name(p->fd);
+            } else {
+                announce_disconnect(p);
+            }
+            return;
+        }
+
+        while (p->disconnect == 0 && p->binary == 0 && get_line(p, line) == 1) {
+            if (p->wait_for_username == 1) {
+                read_name(p, line);
+            } else {
+                read_move(p, line);
+            }
+        }
+
+        // the rest of the input, once the client switched to the binary protocol
+        int type, len, found = 0;
+        while (p->disconnect == 0 && p->binary == 1 && (found = get_frame(p, &type, line, &len)) != 0) {
+            if (found == -1) {  // no valid frame can be that long
+                if (p->wait_for_username == 1) {
+                    write_invalid_name(p->fd);
+                } else {
+                    announce_disconnect(p);
+                }
+                return;
+            }
+            read_frame(p, type, line, len);
+        }
+
+        // the buffer is full but holds no complete line
+        if (p->disconnect == 0 && p->inbuf == MAXMESSAGE) {
+            p->inbuf = 0;
+            if (p->wait_for_username == 1) {    // invalid case1: the username is too long
+                write_invalid_name(p->fd);
+                return;
+            }
+            read_move(p, "");
+        }
+
+        if (nbytes == 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * Handle a complete line sent by potential player p as the username.
+ */
+void read_name(struct player *p, char *name) {
+    char announce_new_player[MAXMESSAGE];
+
+    if (p->binary == 0 && strcmp(name, BINARY) == 0) {  // not a name, switch protocol
+        p->binary = 1;
+        queue_message(p, welcome_msg);
+        return;
+    }
+    if (strncmp(name, WATCH, strlen(WATCH)) == 0
+        && (name[strlen(WATCH)] == '\0' || name[strlen(WATCH)] == ' ')) {   // a spectator, not a name
+        char *arg = name + strlen(WATCH), *end;
+        long id = strtol(arg, &end, 10);
+        while (*end == ' ') {
+            end++;
+        }
+        if (*end != '\0' || id < 0 || id > INT_MAX) {   // not a game id, "/watch 012x" watches nothing
+            queue_message(p, no_game_msg);
+            return;
+        }
+        watch_game(p, id);
+        return;
+    }
+    if (strncmp(name, BOARD, strlen(BOARD)) == 0
+        && (name[strlen(BOARD)] == '\0' || name[strlen(BOARD)] == ' ')) {   // the board to play on, not a name
+        choose_board(p, name + strlen(BOARD));
+        return;
+    }
+    int len = strlen(name);
+    if (len == 0) {    // invalid case2: enter return immediately
+        write_invalid_name(p->fd);
+        return;
+    }
+    if (len > MAXNAME) {   // invalid case1: the username is too long
+        write_invalid_name(p->fd);
+        return;
+    }
+
+    // invalid case3: username already exists in some game of this shard,
+    // unless it is a restored seat waiting for this player to come back
+    struct player *seat = find_name(name);
+    if (seat != NULL && (seat->fd != -1 || seat->bot == 1)) {
+        write_invalid_name(p->fd);
+        return;
+    }
+    if (seat != NULL) {
+        memcpy(p->name, name, len);
+        p->name[len] = '\0';
+        p->wait_for_username = 0;
+        remove_timer(&p->name_timer);
+        add_count(HANDSHAKES, 1);
+        struct game *g = seat->game;
+        take_seat(p, seat);
+
+        sprintf(announce_new_player, "Player %s is back.\r\n", p->name);
+        broadcast(g, announce_new_player, NULL);
+        log_event(LOG_INFO, EV_REJOIN, g, p->name, 0, 0);
+        display_game_state(g);
+        announce_turn(g);
+        return;
+    }
+
+    // Get valid name, leave the lobby and add to a game with a free seat
+    memcpy(p->name, name, len);
+    p->name[len] = '\0';
+    p->wait_for_username = 0;
+    remove_timer(&p->name_timer);
+    add_name(p);
+    add_count(HANDSHAKES, 1);
+    struct game *g = find_game(p->npits, p->npebbles);
+    seat_player(p, g);
+
+    sprintf(announce_new_player, "Player %s is joining in.\r\n", p->name);
+    broadcast(g, announce_new_player, NULL);
+    log_event(LOG_INFO, EV_JOIN, g, p->name, 0, 0);
+
+    // if this is the first player, begin the game immediately
+    if (get_number_players(g) == 1) {
+        g->current = p;
+        journal_event(g, J_CURRENT, p->seat, 0, 0);
+    }
+    // announce game state, unless the bots joining did, and prompt message to get next active fd
+    if (fill_seats(g) == 0) {
+        display_game_state(g);
+    }
+    announce_turn(g);
+}
+
+/*
+ * Handle a complete line sent by player p who is already in the game.
+ */
+void read_move(struct player *p, char *read_number) {
+    if (read_number[0] == '/') {    // a command, allowed at any time
+        read_command(p, read_number + 1);
+        return;
+    }
+
+    int potential_index = -1;
+    if (strlen(read_number) != 0) { // enter nothing, return immediately
+        potential_index = strtol(read_number, NULL, 0);
+    }
+    play_move(p, potential_index);
+}
+
+/*
+ * Handle a complete frame sent by player p speaking the binary protocol.
+ */
+void read_frame(struct player *p, int type, char *payload, int len) {
+    if (p->wait_for_username == 1) {
+        if (type != FRAME_NAME || (int)strlen(payload) != len) {    // no \0 in a name
+            write_invalid_name(p->fd);
+        } else {
+            read_name(p, payload);
+        }
+        return;
+    }
+
+    if (type != FRAME_MOVE) {
+        queue_message(p, unknown_command_msg);
+        return;
+    }
+    unsigned int pit_index;
+    int potential_index = -1;
+    if (get_varint(payload, len, &pit_index) == len && p->game != NULL && pit_index < (unsigned int)p->game->npits) {
+        potential_index = pit_index;
+    }
+    play_move(p, potential_index);
+}
+
+/*
+ * Play pit potential_index for player p if it is his turn and the pit is valid.
+ */
+void play_move(struct player *p, int potential_index) {
+    if (p->watching == 1 || get_current_player(p->game) != p) { // it is not current player's turn to play, junk message
+        queue_message(p, not_move_msg);
+        return;
+    }
+
+    // case1: pit index out of range, case2: pit index within range but with no pebble
+    if (potential_index < 0 || potential_index > (p->game->npits - 1) ||
+        p->pits[potential_index] == 0) {
+        add_count(INVALID_PITS, 1);
+        queue_message(p, invalid_pit_msg);
+        return;
+    }
+
+    // case3: it is the valid index
+    struct game *g = p->game;
+    char announcement[MAXMESSAGE + 20]; // the pebbles and the pit index may take 10 digits each
+    sprintf(announcement, "Player %s distributes %d pebble(s) in pit index %d.\n\r",
+            p->name, p->pits[potential_index], potential_index);
+    broadcast(g, announcement, NULL);
+    log_event(LOG_INFO, EV_MOVE, g, p->name, p->pits[potential_index], potential_index);
+
+    // play the game
+    remove_timer(&g->move_timer);
+    journal_event(g, J_MOVE, p->seat, potential_index, p->pits[potential_index]);
+    long long start = now_ns();
+    turn_game(p, potential_index);
+    add_time(STAGE_TURN, start);
+    add_count(MOVES, 1);
+
+    // announce game state and prompt message to get next active fd
+    start = now_ns();
+    display_game_state(g);
+    add_time(STAGE_DISPLAY, start);
+    if (game_is_over(g)) {
+        end_game(g);
+    } else {
+        announce_turn(g);
+    }
+}
+
+/*
+ * Handle a command line sent by player p, without the leading '/':
+ *   delta   receive the game state as one snapshot, then deltas only
+ *   text    receive the game state as the full board again (the default)
+ *   resync  receive a new snapshot, for a delta client that missed a sequence number
+ */
+void read_command(struct player *p, char *command) {
+    if (p->watching == 1) {
+        queue_message(p, unknown_command_msg);
+    } else if (strcmp(command, "delta") == 0 || strcmp(command, "resync") == 0) {
+        p->delta = 1;
+        struct message *m = snapshot_message(p->game);
+        queue_message(p, m);
+        release_message(m);
+    } else if (strcmp(command, "text") == 0) {
+        p->delta = 0;
+    } else {
+        queue_message(p, unknown_command_msg);
+    }
+}
+
+/*
+ * Prompt the current player of game g to move and tell the others whose move it is.
+ */
+void announce_turn(struct game *g) {
+    struct player *current_player = get_current_player(g);
+    if (current_player != NULL) {
+        queue_message(current_player, move_msg);
+        char announce[MAXMESSAGE + 1];
+        sprintf(announce, "It is %s's move\r\n", current_player->name);
+        broadcast(g, announce, current_player);
+        log_event(LOG_DEBUG, EV_TURN, g, current_player->name, 0, 0);
+
+        // the clock restarts for a new current player, or after a move
+        if (g->clock != current_player || g->move_timer.pprev == NULL) {
+            g->clock = current_player;
+            remove_timer(&g->move_timer);
+            add_timer(&g->move_timer, move_timeout);
+            if (current_player->bot == 1) {
+                think(g);
+            }
+        }
+    }
+}
+
+/*
+ * Remove player p who closed the connection from the game and tell the others,
+ * if it was his turn to play, announce the new current player.
+ */
+void announce_disconnect(struct player *p) {
+    if (p->watching == 1) { // nobody is told about spectators
+        stop_watching(p);
+        return;
+    }
+    struct game *g = p->game;
+    int was_playing = (get_current_player(g) == p);
+
+    const char *disconnect_name = disconnect(p);
+    char announce_disconnect[MAXMESSAGE + 1];
+    sprintf(announce_disconnect, "Player %s disconnected.\r\n", disconnect_name);
+    broadcast(g, announce_disconnect, p);
+    log_event(LOG_INFO, EV_DISCONNECT, g, disconnect_name, 0, 0);
+    fill_seats(g);  // a bot takes the seat, or the bots leave with the last player
+
+    if (g->playerlist == NULL) {    // nobody left at the table
+        free_game(g);
+    } else if (was_playing == 1) {  // announce new player in the game that it is his turn
+        announce_turn(g);
+    }
+}
 
+void parseargs(int argc, char **argv) {
+    int c, status = 0, threads_set = 0;
+    while ((c = getopt(argc, argv, "p:q:s:t:a:l:n:m:w:b:f:i:j:r:g:v:B:k:K:e:S:J:y:o:G:u")) != EOF) {
+        switch (c) {
+            case 'p':
+                port = strtol(optarg, NULL, 0);
+                break;
+            case 'q':
+                max_queue = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                max_seats = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                nthreads = strtol(optarg, NULL, 0);
+                threads_set = 1;
+                break;
+            case 'a':
+                admin_port = strtol(optarg, NULL, 0);
+                break;
+            case 'l':
+                for (log_level = LOG_DEBUG; log_level < LOG_OFF; log_level++) {
+                    if (strcmp(optarg, level_names[log_level]) == 0) {
+                        break;
+                    }
+                }
+                status += (strcmp(optarg, level_names[log_level]) != 0);
+                break;
+            case 'n':
+                name_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'm':
+                move_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'w':
+                write_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                backlog = strtol(optarg, NULL, 0);
+                break;
+            case 'f':
+                snapshot_path = optarg;
+                break;
+            case 'i':
+                snapshot_interval = strtol(optarg, NULL, 0);
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'r':
+                replay_path = optarg;
+                break;
+            case 'g':
+                replay_game = strtol(optarg, NULL, 0);
+                break;
+            case 'v':
+                view_interval = strtol(optarg, NULL, 0);
+                break;
+            case 'B':
+                bot_players = strtol(optarg, NULL, 0);
+                break;
+            case 'k':
+                bot_ms = strtol(optarg, NULL, 0);
+                break;
+            case 'K':
+                bot_threads = strtol(optarg, NULL, 0);
+                break;
+            case 'e':
+                if (strcmp(optarg, "lookup") == 0) {
+                    bench_lookup = 1;
+                } else if (strcmp(optarg, "sow") == 0) {
+                    bench_sow = 1;
+                } else {
+                    bench_players = strtol(optarg, NULL, 0);
+                }
+                break;
+            case 'S':
+                batch_games = strtol(optarg, NULL, 0);
+                break;
+            case 'J':
+                batch_join = strtol(optarg, NULL, 0);
+                break;
+            case 'y':
+                for (batch_policy = 0; batch_policy < NPOLICIES; batch_policy++) {
+                    if (strcmp(optarg, policy_names[batch_policy]) == 0) {
+                        break;
+                    }
+                }
+                status += (batch_policy == NPOLICIES);
+                break;
+            case 'o':
+                batch_path = optarg;
+                break;
+            case 'G':
+                status += (sscanf(optarg, "%dx%d", &default_pits, &default_pebbles) != 2);
+                break;
+            case 'u':
+#ifdef USE_SELECT
+                status++;   // io_uring replaces epoll, there is none in this build
+#endif
+                use_uring = 1;
+                break;
+            default:
+                status++;
+        }
+    }
+    // a client coming back lands on any shard, while its seat and its name are
+    // only known to the shard that restored it
+    status += (snapshot_path != NULL && nthreads > 1);
+    if (batch_games > 0 && threads_set == 0) {  // the simulator uses every core
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (nthreads < 1) ? 1 : nthreads;
+    }
+    if (status || optind != argc || nthreads < 1 || bot_ms < 1 || bot_threads < 0
+        || default_pits < 1 || default_pits > MAXPITS || default_pebbles < 1 || default_pebbles > MAXPEBBLES) {
+        fprintf(stderr, "usage: %s [-p port] [-q maxqueue] [-s seats] [-t threads] [-a adminport]\n"
+                        "       [-l debug|info|warn|off] [-n namesecs] [-m movesecs] [-w writesecs]\n"
+                        "       [-b backlog] [-f snapshotfile] [-i snapshotsecs] [-j journalfile] [-v viewms]\n"
+                        "       [-B botplayers] [-k botms] [-K botthreads] [-G pitsxpebbles] [-u]\n"
+                        "       %s -r journalfile [-g gameid]\n"
+                        "       %s -e players [-k botms] [-K botthreads] [-G pitsxpebbles]\n"
+                        "       %s -e lookup\n"
+                        "       %s -e sow [-G pitsxpebbles]\n"
+                        "       %s -S games [-s players] [-t threads] [-J joinmove] [-y random|extra] [-o columnsfile]\n"
+                        "       [-G pitsxpebbles]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+}
+
+void makelistener() {
+    struct sockaddr_in r;
+
+    // non-blocking, accept_connection() takes connections until there are no more
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if ((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    int on = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                   (const char *) &on, sizeof(on)) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+
+    // every shard binds its own listener, the kernel spreads the connections
+    if (nthreads > 1 && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                   (const char *) &on, sizeof(on)) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = INADDR_ANY;
+    r.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *)&r, sizeof(r))) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(listenfd, backlog)) {
+        perror("listen");
+        exit(1);
+    }
+}
+
+/*
+ * Create the event engine and watch listenfd.
+ */
+void init_events() {
+#ifdef USE_SELECT
+    FD_ZERO(&all_fds);
+    max_fd = listenfd;
+    FD_SET(listenfd, &all_fds);
+#else
+    if (use_uring) {
+        init_uring();
+    } else if ((epfd = epoll_create1(0)) == -1) {
+        perror("server: epoll_create1");
+        exit(1);
+    }
+    watch_fd(listenfd, NULL);
+#endif
+}
+
+/*
+ * Start watching fd for input, data is the struct player owning fd,
+ * or NULL for listenfd. Player fds are edge-triggered and must be
+ * read until there is no more input, they also report when the socket
+ * becomes writable again so queued output can be flushed.
+ */
+void watch_fd(int fd, void *data) {
+#ifdef USE_SELECT
+    (void)data;
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "server: fd %d exceeds FD_SETSIZE\n", fd);
+        exit(1);
+    }
+    if (fd > max_fd) {
+        max_fd = fd;
+    }
+    FD_SET(fd, &all_fds);
+#else
+    if (use_uring) {    // a multishot request, until the fd is closed or out of buffers
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->fd = fd;
+        if (data == NULL) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = URING_ACCEPT;
+        } else {
+            struct player *p = data;
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->user_data = ((unsigned long long)p->serial << 32) | ((unsigned long long)fd << 2) | URING_RECV;
+        }
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = (data == NULL) ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLET);
+    ev.data.ptr = data;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("server: epoll_ctl");
+        exit(1);
+    }
+    add_count(SYSCALLS, 1);
+#endif
+}
+
+/*
+ * Stop watching fd, call this BEFORE closing fd with close_fd().
+ */
+void unwatch_fd(int fd) {
+#ifdef USE_SELECT
+    FD_CLR(fd, &all_fds);
+#else
+    if (use_uring) {
+        // the requests hold the socket open, cancel them before the linked close
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->flags = IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = URING_CLOSE;
+        return;
+    }
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("server: epoll_ctl");
+        exit(1);
+    }
+    add_count(SYSCALLS, 1);
+#endif
+}
+
+/*
+ * Close the client fd right after unwatch_fd(fd).
+ */
+void close_fd(int fd) {
+#ifndef USE_SELECT
+    if (use_uring) {    // after the cancel, the fd is not reused before its requests are gone
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = URING_CLOSE;
+        return;
+    }
+#endif
+    close(fd);
+    add_count(SYSCALLS, 1);
+}
+
+/*
+ * Wait for one batch of events and dispatch them, each ready player is
+ * found directly from its event instead of scanning the playerlist.
+ */
+void wait_events() {
+#ifdef USE_SELECT
+    fd_set listen_fds = all_fds;
+    fd_set write_fds;
+    FD_ZERO(&write_fds);
+    for (struct player *p = blockedlist; p; p = p->next_dirty) {
+        if (p->fd != -1) {
+            FD_SET(p->fd, &write_fds);
+        }
+    }
+
+    int timeout = next_timeout();
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    int nready = select(max_fd + 1, &listen_fds, &write_fds, NULL, (timeout == -1) ? NULL : &tv);
+    add_count(SYSCALLS, 1);
+    if (nready == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        perror("server: select");
+        exit(1);
+    }
+    long long start = now_ns();
+
+    // new player requires connection
+    if (FD_ISSET(listenfd, &listen_fds)) {
+        accept_connection(listenfd);
+    }
+
+    // retry the blocked output that can be written now
+    struct player *blocked = blockedlist;
+    blockedlist = NULL;
+    while (blocked) {
+        struct player *p = blocked;
+        blocked = p->next_dirty;
+        p->dirty = 0;
+        if (p->fd == -1) {
+            continue;   // closed meanwhile
+        } else if (FD_ISSET(p->fd, &write_fds) || p->lagging == 1) {
+            mark_dirty(p);
+        } else {
+            p->next_dirty = blockedlist;
+            blockedlist = p;
+            p->dirty = 1;
+        }
+    }
+
+    // check which players (or potential players) are active through the connection table
+    for (int fd = 0; fd <= max_fd && fd < nconns; fd++) {
+        struct player *p = conns[fd];
+        if (p != NULL && FD_ISSET(fd, &listen_fds) && p->disconnect == 0) {
+            process_player(p);
+        }
+    }
+#else
+    long long start;
+    if (use_uring) {
+        // submits everything queued since the last wait, the sends of the last turn first
+        if (enter_uring(1, next_timeout()) == -1) {
+            return;
+        }
+        start = now_ns();
+        reap_completions();
+    } else {
+        struct epoll_event events[MAXEVENTS];
+
+        int nready = epoll_wait(epfd, events, MAXEVENTS, next_timeout());
+        add_count(SYSCALLS, 1);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                return;
+            }
+            perror("server: epoll_wait");
+            exit(1);
+        }
+        start = now_ns();
+
+        for (int i = 0; i < nready; i++) {
+            struct player *p = events[i].data.ptr;
+            if (p == NULL) {    // new player requires connection
+                accept_connection(listenfd);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                && p->disconnect == 0) {   // skip players dropped earlier in this batch
+                process_player(p);
+            }
+            if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                && p->fd != -1 && p->outlen > 0) {
+                mark_dirty(p);
+            }
+        }
+    }
+#endif
+
+    run_timers();
+    flush_journal();    // the changes are on file before any player sees them
+    flush_players();
+    if (viewlist != NULL && view_timer.pprev == NULL) {
+        feed_watchers();
+        add_timer_ms(&view_timer, view_interval);
+    }
+    flush_watchers();   // after the players, their turn never waits for more than a batch
+    pool_players();
+    add_count(LOOPS, 1);
+    add_time(STAGE_LOOP, start);
+}
+
+#ifndef USE_SELECT
+/*
+ * Create the io_uring of this shard, map its queues and provide it the
+ * input buffers. Only the shard enters it, so the completions are posted
+ * when it waits for them, never in between.
+ */
+void init_uring() {
+    struct io_uring_params params;
+    memset(&params, '\0', sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((uring.fd = syscall(SYS_io_uring_setup, URINGSIZE, &params)) == -1) {
+        perror("server: io_uring_setup");
+        exit(1);
+    }
+
+    // both queues share one mapping, the sqes have their own
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t len = (sq_len > cq_len) ? sq_len : cq_len;
+    char *rings = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring.fd, IORING_OFF_SQ_RING);
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        perror("server: mmap");
+        exit(1);
+    }
+    uring.sq_head = (unsigned int *)(rings + params.sq_off.head);
+    uring.sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    uring.sq_array = (unsigned int *)(rings + params.sq_off.array);
+    uring.sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+    uring.cq_head = (unsigned int *)(rings + params.cq_off.head);
+    uring.cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    uring.cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    for (unsigned int i = 0; i < uring.sq_entries; i++) {
+        uring.sq_array[i] = i;  // every slot submits the sqe of the same index
+    }
+    uring.tail = *uring.sq_tail;
+
+    uring.bufs = mmap(NULL, URINGBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring.bufs == MAP_FAILED) {
+        perror("server: mmap");
+        exit(1);
+    }
+    if ((uring.data = malloc(URINGBUFS * URINGBUFSIZE)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, '\0', sizeof(reg));
+    reg.ring_addr = (unsigned long)uring.bufs;
+    reg.ring_entries = URINGBUFS;
+    reg.bgid = 0;
+    if (syscall(SYS_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("server: io_uring_register");
+        exit(1);
+    }
+    for (int bid = 0; bid < URINGBUFS; bid++) {
+        recycle_buffer(bid);
+    }
+}
+
+/*
+ * Return a cleared sqe, queued with the next io_uring_enter. The caller
+ * fills it in before queueing anything else.
+ */
+struct io_uring_sqe *get_sqe() {
+    if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries) {
+        enter_uring(0, 0);  // the queue is full, submit it without waiting
+        if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries) {
+            fprintf(stderr, "server: io_uring submission queue full\n");
+            exit(1);
+        }
+    }
+    struct io_uring_sqe *sqe = &uring.sqes[uring.tail & uring.sq_mask];
+    memset(sqe, '\0', sizeof(*sqe));
+    uring.tail++;
+    return sqe;
+}
+
+/*
+ * Submit the queued requests with one io_uring_enter. If wait is 1, also
+ * wait up to timeout milliseconds (-1 for no limit) for a completion.
+ * Return -1 if interrupted by a signal, 0 otherwise.
+ */
+int enter_uring(int wait, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0, min_complete = 0;
+    if (wait == 1) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset(&arg, '\0', sizeof(arg));
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (unsigned long)&ts;
+        }
+        // only collect the completions already there if something else is due now
+        min_complete = (timeout != 0 && *uring.cq_head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE));
+    }
+
+    __atomic_store_n(uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+    unsigned int submit = uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    int ret = syscall(SYS_io_uring_enter, uring.fd, submit, min_complete, flags,
+                      (wait == 1) ? &arg : NULL, (wait == 1) ? sizeof(arg) : 0);
+    add_count(SYSCALLS, 1);
+    if (ret == -1) {
+        if (errno == EINTR) {
+            return -1;
+        }
+        if (errno != ETIME && errno != EBUSY && errno != EAGAIN) {  // the timeout, or completions to reap first
+            perror("server: io_uring_enter");
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Dispatch every completion posted by the last io_uring_enter.
+ */
+void reap_completions() {
+    unsigned int head = *uring.cq_head;
+    unsigned int tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+        unsigned long long data = cqe->user_data;
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+        head++;
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);    // the slot is free once copied
+
+        if ((data & 3) == URING_ACCEPT) {
+            complete_accept(res, flags);
+        } else if ((data & 3) == URING_RECV) {
+            complete_recv(data, res, flags);
+        } else if ((data & 3) == URING_SEND) {
+            complete_send((struct uring_send *)(unsigned long)(data & ~3ULL), res);
+        }   // else a cancel or close that failed, the requests of the fd were gone already
+    }
+}
+
+/*
+ * Handle a completion of the multishot accept of listenfd, which the
+ * kernel ends after an error.
+ */
+void complete_accept(int res, unsigned int flags) {
+    if (res >= 0) {
+        open_connection(res);
+    } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -EPROTO) {
+        refuse_connection(listenfd, -res);
+    }
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+        watch_fd(listenfd, NULL);
+    }
+}
+
+/*
+ * Handle a completion of the multishot recv of a client: its input is
+ * taken by read_from() in process_player(), then the buffer is given back.
+ * The completions of a connection closed meanwhile are dropped.
+ */
+void complete_recv(unsigned long long data, int res, unsigned int flags) {
+    int fd = (data >> 2) & 0x3fffffff;
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct player *p = get_player(fd);
+    if (p != NULL && p->serial == (unsigned int)(data >> 32) && p->disconnect == 0) {
+        if (res != -ENOBUFS) {  // out of buffers, nothing was lost
+            uring.input = uring.data + bid * URINGBUFSIZE;
+            uring.inlen = (res > 0) ? res : 0;
+            uring.eof = (res <= 0);
+            process_player(p);
+            uring.inlen = 0;
+            uring.eof = 0;
+        }
+        if ((flags & IORING_CQE_F_MORE) == 0 && (res > 0 || res == -ENOBUFS)
+            && p->fd == fd && p->disconnect == 0) {
+            watch_fd(fd, p);    // the kernel ended the recv, start another
+        }
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        recycle_buffer(bid);
+    }
+}
+
+/*
+ * Queue one sendmsg of the first messages queued for p, unless one is
+ * already in flight, then complete_send() takes over.
+ */
+void send_output(struct player *p) {
+    if (p->sendop != NULL) {
+        return;
+    }
+    if (p->outcount == 0) {
+        sent_output(p);
+        return;
+    }
+
+    struct uring_send *s = uring.freesends;
+    if (s == NULL) {
+        if ((s = malloc(sizeof(struct uring_send))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    } else {
+        uring.freesends = s->next_free;
+    }
+    s->player = p;
+    s->nmsgs = 0;
+    for (int i = 0; i < p->outcount && i < MAXIOV; i++) {
+        struct message *m = p->outq[(p->outhead + i) % p->outcap];
+        int off = (i == 0) ? p->outoff : 0;
+        s->iov[i].iov_base = m->data + off;
+        s->iov[i].iov_len = m->len - off;
+        s->msgs[i] = m;
+        m->refcount++;  // the queue may be dropped before the send completes
+        s->nmsgs++;
+    }
+    memset(&s->msg, '\0', sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = s->nmsgs;
+
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = p->fd;
+    sqe->addr = (unsigned long)&s->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)s | URING_SEND;
+    p->sendop = s;
+    if (p->write_timer.pprev == NULL) {   // until the whole queue is sent
+        add_timer(&p->write_timer, write_timeout);
+    }
+}
+
+/*
+ * Handle the completion of sendmsg s: release the messages it sent, then
+ * send the rest of the queue or finish like flush_output(). A send whose
+ * player was dropped meanwhile only releases its references.
+ */
+void complete_send(struct uring_send *s, int res) {
+    struct player *p = s->player;
+    if (p->sendop == s) {
+        p->sendop = NULL;
+        if (res < 0) {
+            drop_output(p);   // the client is gone, drop the output
+            p->lagging = 1;
+            mark_dirty(p);
+        } else {
+            consume_output(p, res);
+            if (p->outcount > 0) {
+                mark_dirty(p);  // sent with the rest of the output of this iteration
+            } else {
+                sent_output(p);
+            }
+        }
+    }
+
+    for (int i = 0; i < s->nmsgs; i++) {
+        release_message(s->msgs[i]);
+    }
+    s->next_free = uring.freesends;
+    uring.freesends = s;
+}
+
+/*
+ * Give the input buffer bid back to the kernel.
+ */
+void recycle_buffer(int bid) {
+    struct io_uring_buf *b = &uring.bufs->bufs[uring.buftail & (URINGBUFS - 1)];
+    b->addr = (unsigned long)(uring.data + bid * URINGBUFSIZE);
+    b->len = URINGBUFSIZE;
+    b->bid = bid;
+    uring.buftail++;
+    __atomic_store_n(&uring.bufs->tail, uring.buftail, __ATOMIC_RELEASE);
+}
+#endif
+
+/*
+ * Encode the fixed prompts once, they are shared by every client for the
+ * whole life of the server.
+ */
+void init_messages() {
+    welcome_msg = new_message(WELCOME, WELCOME_SIZE);
+    invalid_msg = new_message(INVALID, INVALID_SIZE);
+    move_msg = new_message(MOVE, MOVE_SIZE);
+    not_move_msg = new_message(NOT_MOVE, NOT_MOVE_SIZE);
+    invalid_pit_msg = new_message(INVALID_PIT, INVALID_PIT_SIZE);
+    unknown_command_msg = new_message(UNKNOWN_COMMAND, UNKNOWN_COMMAND_SIZE);
+    timeout_msg = new_message(TIMEOUT, TIMEOUT_SIZE);
+    no_game_msg = new_message(NO_GAME, NO_GAME_SIZE);
+    invalid_board_msg = new_message(INVALID_BOARD, INVALID_BOARD_SIZE);
+
+    // the prompts have a frame type of their own instead of FRAME_TEXT
+    welcome_msg->frame = new_frame(FRAME_WELCOME, NULL, 0);
+    invalid_msg->frame = new_frame(FRAME_INVALID_NAME, NULL, 0);
+    move_msg->frame = new_frame(FRAME_MOVE, NULL, 0);
+    not_move_msg->frame = new_frame(FRAME_NOT_MOVE, NULL, 0);
+    invalid_pit_msg->frame = new_frame(FRAME_INVALID_PIT, NULL, 0);
+}
+
+/*
+ * Return a new message holding a copy of the len bytes of s (or
+ * uninitialized if s is NULL), with one reference owned by the caller.
+ */
+struct message *new_message(const char *s, int len) {
+    struct message *m = malloc(sizeof(struct message) + len);
+    if (m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    m->refcount = 1;
+    m->len = len;
+    m->frame = NULL;
+    if (s != NULL) {
+        memcpy(m->data, s, len);
+    }
+    return m;
+}
+
+/*
+ * Return a new binary frame of type with a copy of the len bytes of payload
+ * (or room for them if payload is NULL), with one reference owned by the caller.
+ */
+struct message *new_frame(int type, const char *payload, int len) {
+    struct message *m = new_message(NULL, FRAME_HEADER + len);
+    put_header(m->data, type, len);
+    if (payload != NULL) {
+        memcpy(m->data + FRAME_HEADER, payload, len);
+    }
+    return m;
+}
+
+/*
+ * Write the header of a frame of type with len bytes of payload at buf.
+ */
+void put_header(char *buf, int type, int len) {
+    unsigned char *header = (unsigned char *)buf;
+    header[0] = (len >> 24) & 0xff;
+    header[1] = (len >> 16) & 0xff;
+    header[2] = (len >> 8) & 0xff;
+    header[3] = len & 0xff;
+    header[4] = type;
+}
+
+/*
+ * Return the binary frame of message m, a FRAME_TEXT built from its text
+ * the first time it is needed. It belongs to m and lives as long as m.
+ */
+struct message *frame_of(struct message *m) {
+    if (m->frame == NULL) {
+        m->frame = new_frame(FRAME_TEXT, m->data, m->len - 1);  // without the \0
+    }
+    return m->frame;
+}
+
+/*
+ * Write v as a varint at buf, return the number of bytes written (at most 5).
+ */
+int put_varint(char *buf, unsigned int v) {
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+/*
+ * Read a varint from the n bytes at buf into v.
+ * Return the number of bytes read, or -1 if buf holds no complete varint.
+ */
+int get_varint(const char *buf, int n, unsigned int *v) {
+    *v = 0;
+    for (int i = 0; i < n && i < 5; i++) {
+        *v |= (unsigned int)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Drop one reference to m, free it when nobody holds it anymore.
+ */
+void release_message(struct message *m) {
+    if (--m->refcount == 0) {
+        if (m->frame != NULL) {
+            release_message(m->frame);
+        }
+        free(m);
+    }
+}
+
+/*
+ * Append m to the output queue of p, it is sent by flush_players()
+ * together with everything else queued in this turn. The queue takes
+ * its own reference, so the same m can be queued for many players.
+ * A client that falls more than max_queue bytes behind is dropped.
+ */
+void queue_message(struct player *p, struct message *m) {
+    if (p->lagging == 1 || p->fd == -1) {
+        return;
+    }
+    if (p->binary == 1) {
+        m = frame_of(m);
+    }
+    if (p->outlen + m->len > max_queue) {
+        p->lagging = 1;
+        drop_output(p);
+        mark_dirty(p);
+        return;
+    }
+
+    if (p->outcount == p->outcap) {
+        int cap = (p->outcap == 0) ? 8 : p->outcap * 2;
+        struct message **outq = malloc(sizeof(struct message *) * cap);
+        if (outq == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        add_count(ALLOCATIONS, 1);
+        for (int i = 0; i < p->outcount; i++) {
+            outq[i] = p->outq[(p->outhead + i) % p->outcap];
+        }
+        free(p->outq);
+        p->outq = outq;
+        p->outhead = 0;
+        p->outcap = cap;
+    }
+    m->refcount++;
+    p->outq[(p->outhead + p->outcount) % p->outcap] = m;
+    p->outcount++;
+    p->outlen += m->len;
+    mark_dirty(p);
+}
+
+/*
+ * Discard everything queued for p.
+ */
+void drop_output(struct player *p) {
+    while (p->outcount > 0) {
+        release_message(p->outq[p->outhead]);
+        p->outhead = (p->outhead + 1) % p->outcap;
+        p->outcount--;
+    }
+    p->outoff = 0;
+    p->outlen = 0;
+    p->sendop = NULL;   // a send still in flight holds its own references
+}
+
+/*
+ * Add p to the dirtylist if it is not there yet.
+ */
+void mark_dirty(struct player *p) {
+    if (p->dirty == 0) {
+        p->dirty = 1;
+        if (p->watching == 1) {
+            p->next_dirty = NULL;
+            if (watchtail != NULL) {
+                watchtail->next_dirty = p;
+            } else {
+                watchdirty = p;
+            }
+            watchtail = p;
+        } else {
+            p->next_dirty = dirtylist;
+            dirtylist = p;
+        }
+    }
+}
+
+/*
+ * Flush the output of every player in the dirtylist with one send each,
+ * and drop the clients that fell too far behind.
+ */
+void flush_players() {
+    long long start = now_ns();
+    while (dirtylist) {
+        struct player *p = dirtylist;
+        dirtylist = p->next_dirty;
+        p->dirty = 0;
+        flush_dirty(p);
+    }
+    add_time(STAGE_FLUSH, start);
+}
+
+/*
+ * Flush the output of at most VIEWBATCH spectators, the others wait for
+ * the next loop iteration, which does not sleep until they are done.
+ */
+void flush_watchers() {
+    if (watchdirty == NULL) {
+        return;
+    }
+    long long start = now_ns();
+    for (int n = 0; watchdirty != NULL && n < VIEWBATCH; n++) {
+        struct player *p = watchdirty;
+        watchdirty = p->next_dirty;
+        if (watchdirty == NULL) {
+            watchtail = NULL;
+        }
+        p->dirty = 0;
+        flush_dirty(p);
+    }
+    add_time(STAGE_VIEWS, start);
+}
+
+/*
+ * Flush the output of p taken off a dirty list, or drop p if it fell behind.
+ */
+void flush_dirty(struct player *p) {
+    if (p->fd == -1) {
+        return;
+    }
+    if (p->lagging == 1) {
+        if (p->disconnect == 1) {
+            close_player(p);
+        } else if (p->wait_for_username == 1) {
+            disconnect_invalid_name(p->fd);
+        } else {
+            log_event(LOG_WARN, EV_BEHIND, p->game, p->name, 0, 0);
+            announce_disconnect(p);
+        }
+        return;
+    }
+    flush_output(p);
+}
+
+/*
+ * Send as much of the output queue of p as the socket takes, gathering
+ * the queued messages into one sendmsg. Close the fd of a disconnected
+ * player once its queue is empty.
+ */
+void flush_output(struct player *p) {
+#ifndef USE_SELECT
+    if (use_uring) {
+        send_output(p);
+        return;
+    }
+#endif
+    while (p->outcount > 0) {
+        struct iovec iov[MAXIOV];
+        int niov = 0;
+        for (int i = 0; i < p->outcount && niov < MAXIOV; i++) {
+            struct message *m = p->outq[(p->outhead + i) % p->outcap];
+            int off = (i == 0) ? p->outoff : 0;
+            iov[niov].iov_base = m->data + off;
+            iov[niov].iov_len = m->len - off;
+            niov++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        int nbytes = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+        add_count(SYSCALLS, 1);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;  // wait for the socket to be writable
+            }
+            drop_output(p);   // the client is gone, drop the output
+            p->lagging = 1;
+            mark_dirty(p);
+            return;
+        }
+
+        consume_output(p, nbytes);
+    }
+    sent_output(p);
+}
+
+/*
+ * Take the nbytes just sent off the front of the output queue of p,
+ * releasing the messages sent completely.
+ */
+void consume_output(struct player *p, int nbytes) {
+    add_count(BYTES_OUT, nbytes);
+    p->outlen -= nbytes;
+    while (nbytes > 0) {
+        struct message *m = p->outq[p->outhead];
+        int left = m->len - p->outoff;
+        if (nbytes < left) {
+            p->outoff += nbytes;
+            break;
+        }
+        nbytes -= left;
+        p->outoff = 0;
+        release_message(m);
+        p->outhead = (p->outhead + 1) % p->outcap;
+        p->outcount--;
+    }
+}
+
+/*
+ * Start the write deadline of p if output is left after a send, otherwise
+ * do what waited for the queue to be empty.
+ */
+void sent_output(struct player *p) {
+    if (p->outcount > 0) {
+        if (p->write_timer.pprev == NULL) {   // the client stopped reading, from now on
+            add_timer(&p->write_timer, write_timeout);
+        }
+#ifdef USE_SELECT
+        p->dirty = 1;
+        p->next_dirty = blockedlist;
+        blockedlist = p;
+#endif
+        return;
+    }
+    remove_timer(&p->write_timer);
+    if (p->disconnect == 1) {
+        close_player(p);
+    } else if (p->stale == 1) {   // a spectator that caught up, send the view it missed
+        p->stale = 0;
+        queue_message(p, p->game->view);
+    }
+}
+
+/*
+ * Close the fd of the disconnected player p, unless output is still
+ * queued for it, in which case flush_output() closes it later.
+ */
+void close_player(struct player *p) {
+    if (p->outlen > 0 && p->lagging == 0) {
+#ifdef USE_SELECT
+        FD_CLR(p->fd, &all_fds);    // stop reading, only the output is left
+#endif
+        mark_dirty(p);
+        return;
+    }
+    remove_timer(&p->name_timer);
+    remove_timer(&p->write_timer);
+    if (p->fd != -1) {  // a restored seat has no connection
+        unwatch_fd(p->fd);
+        close_fd(p->fd);
+        remove_conn(p->fd);
+        p->fd = -1;
+    }
+    drop_output(p);   // outq itself is kept for the next connection using this struct
+
+    p->next_free = closedlist;
+    closedlist = p;
+}
+
+/* call this BEFORE linking the new player in to the list */
+int compute_average_pebbles(struct game *g) {
+    struct player *p;
+    int i;
+
+    if (g->playerlist == NULL) {
+        return g->npebbles;
+    }
+
+    int nplayers = 0, npebbles = 0;
+    for (p = g->playerlist; p; p = p->next) {
+        nplayers++;
+        for (i = 0; i < g->npits; i++) {
+            npebbles += p->pits[i];
+        }
+    }
+    return ((npebbles - 1) / nplayers / g->npits + 1);  /* round up */
+}
+
+int game_is_over(struct game *g) { /* boolean */
+    if (!g->playerlist) {
+        return 0;  /* we haven't even started yet! */
+    }
+
+    // some player has all pits empty, kept up to date by turn_game() and the seat changes
+    return g->nempty > 0;
+}
+
+/*
+ * Broadcast the message s to all the players of game g excepts the player not_announce.
+ * The message is only queued, it is sent by flush_players().
+ */
+void broadcast(struct game *g, char *s, struct player *not_announce) {
+    struct message *m = new_message(s, strlen(s) + 1);
+    broadcast_message(g, m, not_announce);
+    release_message(m);
+}
+
+/*
+ * Queue the shared message m for all the players of game g excepts the player not_announce.
+ */
+void broadcast_message(struct game *g, struct message *m, struct player *not_announce) {
+    long long start = now_ns();
+    for (struct player* p = g->playerlist; p; p = p->next) {
+        if (p != not_announce) {
+            queue_message(p, m);
+        }
+    }
+    add_time(STAGE_BROADCAST, start);
+}
+
+/*
+ * Return a game of npits pits per side and npebbles pebbles per pit with a
+ * free seat for a new player, start a new game if every such game is full.
+ */
+struct game *find_game(int npits, int npebbles) {
+    struct game *next;
+    for (struct game *g = openlist; g; g = next) {
+        next = g->next_open;
+        if (max_seats > 0 && get_number_players(g) >= max_seats) {
+            close_game(g);
+        } else if (g->npits == npits && g->npebbles == npebbles) {
+            return g;
+        }
+    }
+    return new_game(npits, npebbles);
+}
+
+/*
+ * Start a new empty game, open for players.
+ */
+struct game *new_game(int npits, int npebbles) {
+    struct game *g = freegames;
+    if (g != NULL) {
+        freegames = g->next;
+    } else if ((g = malloc(sizeof(struct game))) == NULL) {
+        perror("malloc");
+        exit(1);
+    } else {
+        g->board = NULL;
+        g->sent = NULL;
+        g->seats = NULL;
+        g->boardcap = 0;
+    }
+    g->id = __sync_fetch_and_add(&next_game_id, 1);
+    g->npits = npits;
+    g->npebbles = npebbles;
+    g->playerlist = NULL;
+    g->current = NULL;
+    g->nplayers = 0;
+    g->nempty = 0;
+    g->seq = 0;
+    g->resync = 1;
+    g->open = 0;
+    init_timer(&g->move_timer, TIMER_MOVE, g);
+    g->clock = NULL;
+    g->watchers = NULL;
+    g->nwatchers = 0;
+    g->view = NULL;
+    g->viewed = 0;
+    g->job = NULL;
+    init_timer(&g->bot_timer, TIMER_BOT, g);
+
+    g->front = NULL;
+    g->next = gamelist;
+    if (gamelist != NULL) {
+        gamelist->front = g;
+    }
+    gamelist = g;
+    while (idlewatchers != NULL) {  // the spectators waiting for a game
+        struct player *w = idlewatchers;
+        unlink_watcher(w);
+        link_watcher(w, g);
+    }
+
+    open_game(g);
+    log_event(LOG_INFO, EV_GAME_START, g, NULL, 0, 0);
+    return g;
+}
+
+/*
+ * Add game g to the openlist, new players can be seated in it.
+ */
+void open_game(struct game *g) {
+    if (g->open == 1) {
+        return;
+    }
+    g->open = 1;
+    g->front_open = NULL;
+    g->next_open = openlist;
+    if (openlist != NULL) {
+        openlist->front_open = g;
+    }
+    openlist = g;
+}
+
+/*
+ * Remove game g from the openlist.
+ */
+void close_game(struct game *g) {
+    if (g->open == 0) {
+        return;
+    }
+    g->open = 0;
+    if (g->front_open != NULL) {
+        g->front_open->next_open = g->next_open;
+    } else {
+        openlist = g->next_open;
+    }
+    if (g->next_open != NULL) {
+        g->next_open->front_open = g->front_open;
+    }
+}
+
+/*
+ * Move player p from the lobby into game g, with the pits of a late joiner.
+ */
+void seat_player(struct player *p, struct game *g) {
+    leave_lobby(p);
+
+    int pebbles = compute_average_pebbles(g);
+
+    // the new row goes last, right before the row of the previous head of playerlist
+    if (g->nplayers == g->boardcap) {
+        int n = (g->boardcap == 0) ? 8 : g->boardcap * 2;
+        if ((g->board = realloc(g->board, sizeof(int) * (MAXPITS + 1) * n)) == NULL
+            || (g->sent = realloc(g->sent, sizeof(int) * (MAXPITS + 1) * n)) == NULL
+            || (g->seats = realloc(g->seats, sizeof(struct player *) * n)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        g->boardcap = n;
+        for (int s = 0; s < g->nplayers; s++) {
+            g->seats[s]->pits = g->board + s * (g->npits + 1);
+        }
+    }
+    p->seat = g->nplayers;
+    p->pits = g->board + p->seat * (g->npits + 1);
+    g->seats[p->seat] = p;
+    g->resync = 1;
+
+    p->game = g;
+    reset_pits(p, pebbles);   // avoid setting end pits
+    p->pits[g->npits] = 0;
+    p->nonempty = (pebbles > 0) ? g->npits : 0;
+
+    p->front = NULL;
+    p->next = g->playerlist;
+    if (g->playerlist != NULL) {
+        g->playerlist->front = p;
+    }
+    g->playerlist = p;
+    g->nplayers++;
+    if (p->nonempty == 0) {
+        g->nempty++;
+    }
+    journal_event(g, J_JOIN, p->seat, g->npits, pebbles);
+
+    if (max_seats > 0 && get_number_players(g) >= max_seats) {
+        close_game(g);
+    }
+}
+
+/*
+ * Remove the row of player p from the board of its game, the rows after it
+ * move down by one so the board stays contiguous.
+ */
+void unseat_player(struct player *p) {
+    struct game *g = p->game;
+    int rows = g->nplayers - p->seat - 1;
+
+    memmove(p->pits, p->pits + g->npits + 1, sizeof(int) * (g->npits + 1) * rows);
+    memmove(g->seats + p->seat, g->seats + p->seat + 1, sizeof(struct player *) * rows);
+    for (int s = p->seat; s < p->seat + rows; s++) {
+        g->seats[s]->seat = s;
+        g->seats[s]->pits = g->board + s * (g->npits + 1);
+    }
+    p->pits = NULL;
+    g->resync = 1;
+}
+
+/*
+ * Unlink potential player p from the lobby.
+ */
+void leave_lobby(struct player *p) {
+    if (p->front != NULL) {
+        p->front->next = p->next;
+    } else {
+        lobby = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->front = p->front;
+    }
+}
+
+/*
+ * Give potential player p, who sent the name of the restored seat, its place:
+ * the same row, the same place in playerlist and the turn if it had it.
+ */
+void take_seat(struct player *p, struct player *seat) {
+    struct game *g = seat->game;
+    leave_lobby(p);
+
+    p->game = g;
+    p->seat = seat->seat;
+    p->pits = seat->pits;
+    p->nonempty = seat->nonempty;
+    g->seats[p->seat] = p;
+
+    p->front = seat->front;
+    p->next = seat->next;
+    if (p->front != NULL) {
+        p->front->next = p;
+    } else {
+        g->playerlist = p;
+    }
+    if (p->next != NULL) {
+        p->next->front = p;
+    }
+    if (g->current == seat) {
+        g->current = p;
+    }
+
+    remove_name(seat);
+    add_name(p);
+    seat->disconnect = 1;
+    seat->game = NULL;
+    seat->pits = NULL;
+    close_player(seat);
+}
+
+/*
+ * Announce the result of game g, disconnect its players and recycle it.
+ */
+void end_game(struct game *g) {
+    char msg[MAXMESSAGE];
+
+    broadcast(g, "Game over!\r\n", NULL);
+    log_event(LOG_INFO, EV_GAME_OVER, g, NULL, 0, 0);
+    journal_event(g, J_END, 0, 0, 0);
+    release_watchers(g);
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        int points = 0;
+        for (int i = 0; i <= g->npits; i++) {
+            points += p->pits[i];
+        }
+        log_event(LOG_INFO, EV_POINTS, g, p->name, points, 0);
+        snprintf(msg, MAXMESSAGE, "%s has %d points\r\n", p->name, points);
+        broadcast(g, msg, NULL);
+    }
+
+    struct player *next;
+    for (struct player *p = g->playerlist; p; p = next) {
+        next = p->next;
+        remove_name(p);
+        p->disconnect = 1;
+        p->game = NULL;
+        p->pits = NULL;
+        close_player(p);
+    }
+    g->playerlist = NULL;
+    g->current = NULL;
+    g->nplayers = 0;
+    g->nempty = 0;
+    free_game(g);
+}
+
+/*
+ * Remove the empty game g from gamelist and keep it for reuse.
+ */
+void free_game(struct game *g) {
+    log_event(LOG_INFO, EV_GAME_END, g, NULL, 0, 0);
+    release_watchers(g);
+    remove_timer(&g->move_timer);
+    cancel_job(g);
+    close_game(g);
+    if (g->front != NULL) {
+        g->front->next = g->next;
+    } else {
+        gamelist = g->next;
+    }
+    if (g->next != NULL) {
+        g->next->front = g->front;
+    }
+    g->next = freegames;
+    freegames = g;
+}
+
+/*
+ * Accept every pending connection request of listenfd.
+ * Return the number of new players. A transient error only stops this
+ * batch, the listener stays readable if connections are still pending.
+ */
+int accept_connection(int listenfd) { // the file descriptor used for listen
+    int accepted = 0;
+    while (1) {
+        int client_fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        add_count(SYSCALLS, 1);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;  // the queue is drained
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;   // this request is gone, try the next one
+            }
+            if (refuse_connection(listenfd, errno) == 0) {
+                break;
+            }
+            continue;
+        }
+
+        open_connection(client_fd);
+        accepted++;
+    }
+    return accepted;
+}
+
+/*
+ * Count the connection request of listenfd that failed with error. Out of
+ * fds, take it off the queue with the reserve fd and close it.
+ * Return 1 if the next request may still be accepted, 0 otherwise.
+ */
+int refuse_connection(int listenfd, int error) {
+    if ((error == EMFILE || error == ENFILE) && reserve_fd != -1) {
+        // free the reserve to take the connection off the queue and close it
+        close(reserve_fd);
+        int client_fd = accept(listenfd, NULL, NULL);
+        if (client_fd >= 0) {
+            close(client_fd);
+        }
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        add_count(SYSCALLS, 4);
+        if (client_fd < 0) {
+            return 0;   // accept4 fails before it looks at the queue, which is empty
+        }
+    }
+    add_count(REFUSED, 1);
+    log_event(LOG_WARN, EV_REFUSED, NULL, NULL, error, 0);
+    return (error == EMFILE || error == ENFILE);    // else ENOBUFS, ENOMEM and the like, retry on the next event
+}
+
+/*
+ * Welcome the new client connected on client_fd.
+ */
+void open_connection(int client_fd) {
+    // the output of a loop goes out in one write per player, waiting for the ack
+    // of the last one before sending it only stalls the next turn
+    int on = 1;
+    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        perror("setsockopt");   // the client still plays, only with Nagle on
+    }
+    add_count(ACCEPTS, 1);
+    log_event(LOG_INFO, EV_CONNECT, NULL, NULL, 0, 0);
+    initialize_player(client_fd);
+    watch_fd(client_fd, lobby);
+    queue_message(lobby, welcome_msg);
+}
+
+/*
+ * Reset the numbers of peddles in each pits of current player.
+ */
+void reset_pits(struct player *current_player, int pebbles) {
+    for (int i = 0; i < current_player->game->npits; i++) {
+        current_player->pits[i] = pebbles;
+    }
+}
+
+/*
+ * Put pebbles in pit of the seated player p, keeping the count of nonempty
+ * pits of p and of empty players of its game up to date.
+ */
+void set_pit(struct player *p, int pit, int pebbles) {
+    if (pit < p->game->npits && (p->pits[pit] > 0) != (pebbles > 0)) {
+        if (pebbles > 0 && p->nonempty++ == 0) {
+            p->game->nempty--;
+        } else if (pebbles == 0 && --p->nonempty == 0) {
+            p->game->nempty++;
+        }
+    }
+    p->pits[pit] = pebbles;
+}
+
+/*
+ * Initialize the player struct with given client_fd, add to the lobby,
+ * the pits are set once the player is seated in a game.
+ */
+void initialize_player(int client_fd) {
+    struct player *new_player = alloc_player();
+
+    new_player->fd = client_fd;
+    new_player->serial = ++next_serial;
+    new_player->game = NULL;
+    new_player->pits = NULL;
+    if (client_fd != -1) {
+        add_conn(new_player);
+    }
+
+    new_player->next = lobby;
+    if (lobby != NULL) {
+        lobby->front = new_player;
+    }
+    lobby = new_player;
+    new_player->front = NULL;
+
+    new_player->wait_for_username = 1;
+    new_player->nonempty = 0;
+    new_player->disconnect = 0;
+    new_player->watching = 0;
+    new_player->bot = 0;
+    new_player->npits = default_pits;
+    new_player->npebbles = default_pebbles;
+    new_player->stale = 0;
+    new_player->inbuf = 0;
+    new_player->skip_lf = 0;
+    new_player->outhead = 0;
+    new_player->outcount = 0;
+    new_player->outoff = 0;
+    new_player->outlen = 0;
+    new_player->lagging = 0;
+    new_player->sendop = NULL;
+    new_player->dirty = 0;
+    new_player->delta = 0;
+    new_player->binary = 0;
+    init_timer(&new_player->name_timer, TIMER_NAME, new_player);
+    init_timer(&new_player->write_timer, TIMER_WRITE, new_player);
+    add_timer(&new_player->name_timer, name_timeout);
+}
+
+/*
+ * Return a player struct from the pool, refilled SLABSIZE structs at a time.
+ * A pooled struct keeps the outq of its previous connection.
+ */
+struct player *alloc_player() {
+    if (freeplayers == NULL) {
+        struct player *slab = malloc(sizeof(struct player) * SLABSIZE);
+        if (slab == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        add_count(ALLOCATIONS, 1);
+        for (int i = 0; i < SLABSIZE; i++) {
+            slab[i].outq = NULL;
+            slab[i].outcap = 0;
+            slab[i].next_free = freeplayers;
+            freeplayers = &slab[i];
+        }
+    }
+
+    struct player *p = freeplayers;
+    freeplayers = p->next_free;
+    return p;
+}
+
+/*
+ * Return the players closed in this loop iteration to the pool. Events of
+ * this iteration may still point to them, so this runs after the dispatch.
+ */
+void pool_players() {
+    struct player *p = closedlist;
+    closedlist = NULL;
+    while (p) {
+        struct player *next = p->next_free;
+        if (p->dirty == 1) {    // still in the blockedlist, wait one more iteration
+            p->next_free = closedlist;
+            closedlist = p;
+        } else {
+            p->next_free = freeplayers;
+            freeplayers = p;
+        }
+        p = next;
+    }
+}
+
+
+/*
+ * Return the index of first occurrence of \n,
+ * otherwise return -1.
+ */
+int find_newline(const char *buf, int n) {
+    for (int i = 0; i < n; i++) {
+        if (buf[i] == '\r') {
+            return i;
+        } else if (buf[i] == '\n') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Do one bounded read from the non-blocking client of p into p->buf,
+ * with -u a copy of the input of the recv completion being dispatched.
+ * Return the number of bytes read, 0 if no more input is available now
+ * (or buf is full), or -1 if the client closed the connection.
+ */
+int read_from(struct player *p) {
+    int room = MAXMESSAGE - p->inbuf;  // number bytes remaining in buf
+    if (room == 0) {
+        return 0;
+    }
+
+#ifndef USE_SELECT
+    if (use_uring) {    // the input came with the recv completion being dispatched
+        if (uring.inlen == 0) {
+            return (uring.eof == 1) ? -1 : 0;
+        }
+        int nbytes = (uring.inlen < room) ? uring.inlen : room;
+        memcpy(p->buf + p->inbuf, uring.input, nbytes);
+        uring.input += nbytes;
+        uring.inlen -= nbytes;
+        p->inbuf += nbytes;
+        add_count(BYTES_IN, nbytes);
+        return nbytes;
+    }
+#endif
+
+    long long start = now_ns();
+    int nbytes = read(p->fd, p->buf + p->inbuf, room);
+    add_count(SYSCALLS, 1);
+    add_time(STAGE_READ, start);
+    if (nbytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    } else if (nbytes == 0) {
+        return -1;
+    }
+
+    p->inbuf += nbytes;
+    add_count(BYTES_IN, nbytes);
+    return nbytes;
+}
+
+/*
+ * Move the first complete line in p->buf, without the network newline,
+ * into line (at least MAXMESSAGE + 1 bytes).
+ * Return 1 if a line was found, 0 otherwise.
+ */
+int get_line(struct player *p, char *line) {
+    if (p->skip_lf == 1 && p->inbuf > 0) {
+        if (p->buf[0] == '\n') {
+            memmove(p->buf, p->buf + 1, p->inbuf - 1);
+            p->inbuf -= 1;
+        }
+        p->skip_lf = 0;
+    }
+
+    int newline = find_newline(p->buf, p->inbuf);
+    if (newline == -1) {
+        return 0;
+    }
+
+    memcpy(line, p->buf, newline);
+    line[newline] = '\0';
+
+    // a \r may be followed by \n, consume them together
+    int consumed = newline + 1;
+    if (p->buf[newline] == '\r') {
+        if (consumed < p->inbuf) {
+            if (p->buf[consumed] == '\n') {
+                consumed++;
+            }
+        } else {
+            p->skip_lf = 1;
+        }
+    }
+
+    p->inbuf -= consumed;
+    memmove(p->buf, p->buf + consumed, p->inbuf);
+    return 1;
+}
+
+/*
+ * Move the first complete frame in p->buf into type, payload (at least
+ * MAXMESSAGE + 1 bytes, \0 terminated) and len.
+ * Return 1 if a frame was found, 0 otherwise, or -1 if the frame is too
+ * long to ever fit in p->buf.
+ */
+int get_frame(struct player *p, int *type, char *payload, int *len) {
+    if (p->skip_lf == 1 && p->inbuf > 0) {  // the \r\n of the BINARY line was split
+        if (p->buf[0] == '\n') {
+            memmove(p->buf, p->buf + 1, p->inbuf - 1);
+            p->inbuf -= 1;
+        }
+        p->skip_lf = 0;
+    }
+    if (p->inbuf < FRAME_HEADER) {
+        return 0;
+    }
+
+    unsigned char *header = (unsigned char *)p->buf;
+    unsigned int n = ((unsigned int)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    if (n > MAXMESSAGE - FRAME_HEADER) {
+        return -1;
+    }
+    if (p->inbuf < FRAME_HEADER + (int)n) {
+        return 0;
+    }
+
+    *type = header[4];
+    memcpy(payload, p->buf + FRAME_HEADER, n);
+    payload[n] = '\0';
+    *len = n;
+
+    p->inbuf -= FRAME_HEADER + n;
+    memmove(p->buf, p->buf + FRAME_HEADER + n, p->inbuf);
+    return 1;
+}
+
+/*
+ * Disconnect the potential player with fd whose name is invalid.
+ */
+void disconnect_invalid_name(int fd) {
+    disconnect(get_player(fd));
+    log_event(LOG_INFO, EV_INVALID_NAME, NULL, NULL, 0, 0);
+}
+
+/*
+ * Tell the potential player with fd that the name is invalid and disconnect.
+ */
+void write_invalid_name(int fd) {
+    add_count(INVALID_NAMES, 1);
+    queue_message(get_player(fd), invalid_msg);
+    disconnect_invalid_name(fd);
+}
+
+/*
+ * Display the game state of game g to its players and the server.
+ * The board is formatted once into a single message shared by everyone.
+ * Delta clients get only the pits changed since the previous state instead,
+ * or a new snapshot if rows were added or removed since then.
+ */
+void display_game_state(struct game *g) {
+    int num_players = get_number_players(g);
+    struct message *m = new_message(NULL, BOARDLINE(g->npits) * num_players + 1);
+    m->len = format_board(g, m->data) + 1;
+
+    g->seq++;
+    struct message *d = NULL;   // built for the first delta client only
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        if (p->binary == 1 && m->frame == NULL) {
+            m->frame = state_frame(g);  // binary clients get the whole board, packed
+        }
+        if (p->delta == 0 || p->binary == 1) {
+            queue_message(p, m);
+        } else {
+            if (d == NULL) {
+                d = (g->resync == 1) ? snapshot_message(g) : delta_message(g);
+            }
+            queue_message(p, d);
+        }
+    }
+    memcpy(g->sent, g->board, sizeof(int) * (g->npits + 1) * num_players);
+    g->resync = 0;
+    // once per state whatever the number of players, each encoding built at most once
+    add_count(BYTES_FORMATTED, m->len + ((m->frame != NULL) ? m->frame->len : 0) + ((d != NULL) ? d->len : 0));
+
+    log_board(g);
+    release_message(m);
+    if (d != NULL) {
+        release_message(d);
+    }
+    if (g->watchers != NULL) {
+        mark_viewed(g);
+    }
+}
+
+/*
+ * Write the board of game g as text into buf, one line per player,
+ * MAXNAME + 1 + g->npits * (4 + 11) + 24 bytes per line at most.
+ * Return its length, not including the \0.
+ */
+int format_board(struct game *g, char *buf) {
+    int len = 0;
+    for (struct player* p = g->playerlist; p; p = p->next) {
+        len += sprintf(buf + len, "%s:", p->name);
+        for (int i = 0; i < g->npits; i++) {
+            len += sprintf(buf + len, " [%d]%d", i, p->pits[i]);
+        }
+        len += sprintf(buf + len, " [end pit]%d\r\n", p->pits[g->npits]);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Return the current state of g as a FRAME_STATE for binary clients.
+ */
+struct message *state_frame(struct game *g) {
+    int n = get_number_players(g);
+    struct message *m = new_message(NULL, FRAME_HEADER + 15 + n * ((g->npits + 2) * 5 + MAXNAME));
+    char *payload = m->data + FRAME_HEADER;
+    int len = 0;
+
+    len += put_varint(payload + len, g->seq);
+    len += put_varint(payload + len, n);
+    len += put_varint(payload + len, g->npits);
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        for (int i = 0; i <= g->npits; i++) {
+            len += put_varint(payload + len, p->pits[i]);
+        }
+        int namelen = strlen(p->name);
+        len += put_varint(payload + len, namelen);
+        memcpy(payload + len, p->name, namelen);
+        len += namelen;
+    }
+
+    put_header(m->data, FRAME_STATE, len);
+    m->len = FRAME_HEADER + len;
+    return m;
+}
+
+/*
+ * Return the current state of g for a delta client:
+ *   SNAPSHOT <seq> <number of rows>\r\n
+ * then one row per player, in playerlist order:
+ *   <pit 0> ... <pit npits-1> <end pit> <name>\r\n
+ */
+struct message *snapshot_message(struct game *g) {
+    int line_size = g->npits * 12 + 12 + MAXNAME + 3;
+    struct message *m = new_message(NULL, 40 + line_size * get_number_players(g) + 1);
+    int len = sprintf(m->data, "SNAPSHOT %d %d\r\n", g->seq, get_number_players(g));
+
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        for (int i = 0; i <= g->npits; i++) {
+            len += sprintf(m->data + len, "%d ", p->pits[i]);
+        }
+        len += sprintf(m->data + len, "%s\r\n", p->name);
+    }
+    m->len = len + 1;
+    return m;
+}
+
+/*
+ * Return the pits of g changed since the last state sent:
+ *   DELTA <seq> <row>.<pit>=<pebbles> ...\r\n
+ * where row is the position of the player in the last snapshot. A client
+ * that sees a seq other than its last one plus 1 sends /resync.
+ */
+struct message *delta_message(struct game *g) {
+    int n = get_number_players(g);
+    struct message *m = new_message(NULL, 30 + n * (g->npits + 1) * 36 + 3);
+    int len = sprintf(m->data, "DELTA %d", g->seq);
+
+    for (int s = 0; s < n; s++) {
+        int *pits = g->board + s * (g->npits + 1);
+        int *sent = g->sent + s * (g->npits + 1);
+        for (int i = 0; i <= g->npits; i++) {
+            if (pits[i] != sent[i]) {
+                len += sprintf(m->data + len, " %d.%d=%d", n - 1 - s, i, pits[i]); // rows are listed newest first
+            }
+        }
+    }
+    len += sprintf(m->data + len, "\r\n");
+    m->len = len + 1;
+    return m;
+}
+
+/*
+ * Remove disconnect_player from its game (or the lobby),
+ * if it was his turn to play, the turn passes to the next player.
+ * Return the name of the disconnected player if avaliable, valid until the end of
+ * this loop iteration.
+ */
+const char *disconnect(struct player *disconnect_player) {
+    const char *disconnect_name;
+    disconnect_player->disconnect = 1;
+    remove_timer(&disconnect_player->name_timer);
+
+    // the struct is pooled only at the end of this loop iteration, so the name stays valid
+    if (disconnect_player->wait_for_username == 0) {
+        disconnect_name = disconnect_player->name;
+        remove_name(disconnect_player);
+    } else {
+        disconnect_name = INVALID_NAME_DISCONNECT;
+    }
+
+    struct game *g = disconnect_player->game;
+
+    // disconnect when it is his turn play
+    if (g != NULL && g->current == disconnect_player) {
+        struct player *next = get_next_player(disconnect_player);
+        g->current = (next != disconnect_player) ? next : NULL;
+    }
+    if (g != NULL) {
+        journal_event(g, J_LEAVE, disconnect_player->seat, 0, 0);
+        unseat_player(disconnect_player);
+        g->nplayers--;
+        if (disconnect_player->nonempty == 0) {
+            g->nempty--;
+        }
+    }
+
+    struct player **list = (g != NULL) ? &g->playerlist : &lobby;
+    if (disconnect_player->front != NULL) {
+        disconnect_player->front->next = disconnect_player->next;
+    } else {    // disconnect the head
+        *list = disconnect_player->next;
+    }
+    if (disconnect_player->next != NULL) {
+        disconnect_player->next->front = disconnect_player->front;
+    }
+
+    // a seat is free again
+    if (g != NULL && g->playerlist != NULL) {
+        open_game(g);
+    }
+
+    close_player(disconnect_player);
+
+    return disconnect_name;
+}
+
+/*
+ * Play game in one turn.
+ * The common board sizes get a copy of turn_kernel() of their own, with
+ * npits known at compile time so its loops are unrolled.
+ */
+void turn_game(struct player *turn_player, int pit_index) {
+    switch (turn_player->game->npits) {
+        case 6:
+            turn_kernel(turn_player, pit_index, 6);
+            break;
+        case 4:
+            turn_kernel(turn_player, pit_index, 4);
+            break;
+        case 8:
+            turn_kernel(turn_player, pit_index, 8);
+            break;
+        default:
+            turn_kernel(turn_player, pit_index, turn_player->game->npits);
+    }
+}
+
+/*
+ * Play pit_index of turn_player on a board of npits pits per side.
+ * The pebbles go around a ring of nplayers * npits + 1 pits: the pits of all
+ * players in playerlist order, plus the end pit of turn_player only. Whole
+ * laps are added to the board at once, then the remainder is sown.
+ */
+inline __attribute__((always_inline)) void turn_kernel(struct player *turn_player, int pit_index, int npits) {
+    struct game *g = turn_player->game;
+    int pebbles = turn_player->pits[pit_index]; // number of pits to distribute
+    int play_again = 0; // set to 0 if current player can play again
+
+    turn_player->pits[pit_index] = 0;
+    if (--turn_player->nonempty == 0) {
+        g->nempty++;
+    }
+
+    int ring = g->nplayers * npits + 1;
+    int laps = (pebbles < ring) ? 0 : pebbles / ring;   // no division for the usual move
+    if (laps > 0) {
+        int size = g->nplayers * (npits + 1);
+        for (int i = 0; i < size; i++) {
+            g->board[i] += laps;
+        }
+        for (int s = 0; s < g->nplayers; s++) {
+            if (s != turn_player->seat) {
+                g->board[s * (npits + 1) + npits] -= laps;  // the end pits of other players are skipped
+            }
+            g->seats[s]->nonempty = npits;
+        }
+        g->nempty = 0;
+        pebbles -= laps * ring;
+    }
+
+    // the rest of his own side, then the other players, at most once around
+    int sown = sow_pits(turn_player, pit_index + 1, npits + 1, pebbles, npits);
+    pebbles -= sown;
+    if (pebbles == 0 && pit_index + sown == npits) {   // the last pebble is in his end pit
+        play_again = 1;
+    }
+    for (int s = turn_player->seat; pebbles > 0; ) {
+        s = (s == 0) ? g->nplayers - 1 : s - 1;     // the row of the next player
+        struct player *p = g->seats[s];
+        pebbles -= sow_pits(p, 0, (p == turn_player) ? npits + 1 : npits, pebbles, npits);
+    }
+
+    if (play_again == 0) {
+        g->current = get_next_player(turn_player);
+    }
+}
+
+/*
+ * Sow one pebble in each of the pits from..to-1 of player p, whose pit npits
+ * is the end pit, stopping early when pebbles run out. Keeps the counts that
+ * game_is_over() reads. Return the number of pebbles sown.
+ * Every pit of the row is visited without a branch, so a kernel with npits
+ * known at compile time is fully unrolled.
+ */
+inline __attribute__((always_inline)) int sow_pits(struct player *p, int from, int to, int pebbles, int npits) {
+    if (to - from > pebbles) {
+        to = from + pebbles;
+    }
+    int filled = 0;     // pits that were empty, not including the end pit
+    for (int i = 0; i <= npits; i++) {
+        int sown = (i >= from) & (i < to);
+        filled += sown & (p->pits[i] == 0) & (i < npits);
+        p->pits[i] += sown;
+    }
+    if (filled > 0 && p->nonempty == 0) {
+        p->game->nempty--;
+    }
+    p->nonempty += filled;
+    return to - from;
+}
+
+
+/*
+ * Get number of player in game g.
+ */
+int get_number_players(struct game *g) {
+    return g->nplayers;
+}
+
+/*
+ * Get the player with input fd from the connection table.
+ */
+struct player *get_player(int fd) {
+    if (fd < 0 || fd >= nconns) {
+        return NULL;
+    }
+    return conns[fd];
+}
+
+/*
+ * Put player p in the connection table under its fd, growing the table if needed.
+ */
+void add_conn(struct player *p) {
+    if (p->fd >= nconns) {
+        int n = (nconns == 0) ? 64 : nconns;
+        while (n <= p->fd) {
+            n *= 2;
+        }
+        if ((conns = realloc(conns, sizeof(struct player *) * n)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(conns + nconns, 0, sizeof(struct player *) * (n - nconns));
+        nconns = n;
+    }
+    conns[p->fd] = p;
+}
+
+/*
+ * Remove the connection with fd from the connection table.
+ */
+void remove_conn(int fd) {
+    if (fd >= 0 && fd < nconns) {
+        conns[fd] = NULL;
+    }
+}
+
+/*
+ * Return the FNV-1a hash of name.
+ */
+unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Return the seated player of this shard called name, or NULL if there is none.
+ */
+struct player *find_name(const char *name) {
+    if (nnames == 0) {
+        return NULL;
+    }
+    for (unsigned int i = hash_name(name) & (namecap - 1); names[i] != NULL; i = (i + 1) & (namecap - 1)) {
+        if (strcmp(names[i]->name, name) == 0) {
+            return names[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Put player p in names under p->name, which is not there yet.
+ * The table is kept at most half full so the probes stay short.
+ */
+void add_name(struct player *p) {
+    if (2 * (nnames + 1) > namecap) {
+        struct player **old = names;
+        int oldcap = namecap;
+        namecap = (namecap == 0) ? 64 : namecap * 2;
+        if ((names = calloc(namecap, sizeof(struct player *))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        nnames = 0;
+        for (int i = 0; i < oldcap; i++) {
+            if (old[i] != NULL) {
+                add_name(old[i]);
+            }
+        }
+        free(old);
+    }
+
+    unsigned int i = hash_name(p->name) & (namecap - 1);
+    while (names[i] != NULL) {
+        i = (i + 1) & (namecap - 1);
+    }
+    names[i] = p;
+    nnames++;
+}
+
+/*
+ * Remove player p from names. The entries after it in the same run are
+ * shifted back into the hole, so no tombstones are needed.
+ */
+void remove_name(struct player *p) {
+    if (nnames == 0) {
+        return;
+    }
+    unsigned int mask = namecap - 1;
+    unsigned int i = hash_name(p->name) & mask;
+    while (names[i] != p) {
+        if (names[i] == NULL) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    unsigned int hole = i;
+    for (unsigned int j = (i + 1) & mask; names[j] != NULL; j = (j + 1) & mask) {
+        unsigned int home = hash_name(names[j]->name) & mask;
+        // names[j] may move to the hole unless its home lies after the hole, up to j
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            names[hole] = names[j];
+            hole = j;
+        }
+    }
+    names[hole] = NULL;
+    nnames--;
+}
+
+/*
+ * Return the next player of current_player in the game.
+ */
+struct player *get_next_player(struct player *current_player) {
+    struct player *next_player = NULL;
+    if (current_player->next != NULL) {
+        next_player = current_player->next;
+    } else {
+        next_player = current_player->game->playerlist;
+    }
+    return next_player;
+}
+
+/*
+ * Return the player who plays the current turn of game g.
+ */
+struct player *get_current_player(struct game *g) {
+    return g->current;
+}
+
+/*
+ * Add n to counter of this shard.
+ */
+void add_count(int counter, long n) {
+    __atomic_store_n(&stats->count[counter], stats->count[counter] + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the monotonic time in nanoseconds.
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Count the time spent in stage since start in the histogram of this shard.
+ */
+void add_time(int stage, long long start) {
+    long long ns = now_ns() - start;
+    int bucket = 0;
+    if (ns >= 256) {    // 2^(bucket+8) > ns
+        bucket = 64 - __builtin_clzll(ns) - 8;
+    }
+    if (bucket >= NBUCKETS) {
+        bucket = NBUCKETS - 1;
+    }
+    __atomic_store_n(&stats->hist[stage][bucket], stats->hist[stage][bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->time_ns[stage], stats->time_ns[stage] + ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Serve the stats of all shards on admin_port of the loopback interface,
+ * one plain HTTP response per connection, in its own thread.
+ */
+void *run_admin(void *arg) {
+    struct sockaddr_in r;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("admin: socket");
+        exit(1);
+    }
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on)) == -1) {
+        perror("admin: setsockopt");
+        exit(1);
+    }
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    r.sin_port = htons(admin_port);
+    if (bind(fd, (struct sockaddr *)&r, sizeof(r))) {
+        perror("admin: bind");
+        exit(1);
+    }
+    if (listen(fd, 5)) {
+        perror("admin: listen");
+        exit(1);
+    }
+
+    while (1) {
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd < 0) {
+            continue;
+        }
+        // the request does not matter, read it so closing does not reset the connection
+        char request[1024];
+        struct timeval timeout = { 1, 0 };
+        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+            perror("admin: setsockopt");    // without the timeout a silent client would block the thread
+            close(client_fd);
+            continue;
+        }
+        if (read(client_fd, request, sizeof(request)) <= 0) {
+            close(client_fd);   // hung up, timed out or failed before asking, no one to answer
+            continue;
+        }
+
+        FILE *out = fdopen(client_fd, "w");
+        if (out == NULL) {
+            close(client_fd);
+            continue;
+        }
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+        write_stats(out);
+        fclose(out);
+    }
+
+    return NULL;
+}
+
+/*
+ * Write the stats of all shards added up to out, in the Prometheus text format.
+ */
+void write_stats(FILE *out) {
+    for (int c = 0; c < NCOUNTERS; c++) {
+        long total = 0;
+        for (int i = 0; i < nthreads; i++) {
+            total += __atomic_load_n(&allstats[i].count[c], __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# TYPE mancsrv_%s_total counter\n", counter_names[c]);
+        fprintf(out, "mancsrv_%s_total %ld\n", counter_names[c], total);
+    }
+    fprintf(out, "# TYPE mancsrv_resident_bytes gauge\n");
+    fprintf(out, "mancsrv_resident_bytes %ld\n", resident_bytes());
+
+    fprintf(out, "# TYPE mancsrv_stage_seconds histogram\n");
+    for (int s = 0; s < NSTAGES; s++) {
+        long total = 0, time_ns = 0;
+        for (int b = 0; b < NBUCKETS; b++) {
+            for (int i = 0; i < nthreads; i++) {
+                total += __atomic_load_n(&allstats[i].hist[s][b], __ATOMIC_RELAXED);
+            }
+            if (b < NBUCKETS - 1) {
+                fprintf(out, "mancsrv_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %ld\n",
+                        stage_names[s], (double)(1LL << (b + 8)) / 1e9, total);
+            } else {
+                fprintf(out, "mancsrv_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %ld\n",
+                        stage_names[s], total);
+            }
+        }
+        for (int i = 0; i < nthreads; i++) {
+            time_ns += __atomic_load_n(&allstats[i].time_ns[s], __ATOMIC_RELAXED);
+        }
+        fprintf(out, "mancsrv_stage_seconds_sum{stage=\"%s\"} %g\n", stage_names[s], time_ns / 1e9);
+        fprintf(out, "mancsrv_stage_seconds_count{stage=\"%s\"} %ld\n", stage_names[s], total);
+    }
+}
+
+/*
+ * Return the resident set size of the server in bytes, 0 if it is unknown.
+ */
+long resident_bytes() {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*d %ld", &pages) != 1) {    // the total size, then the resident pages
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Log event of game g (or NULL) about the player called name (or NULL),
+ * a and b are the numbers the event carries, if level is high enough.
+ */
+void log_event(int level, int event, struct game *g, const char *name, int a, int b) {
+    struct log_record *rec = start_record(level, event, g, name);
+    if (rec != NULL) {
+        rec->a = a;
+        rec->b = b;
+        end_record();
+    }
+}
+
+/*
+ * Log the board of game g, one EV_BOARD record per row, at LOG_DEBUG.
+ */
+void log_board(struct game *g) {
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        struct log_record *rec = start_record(LOG_DEBUG, EV_BOARD, g, p->name);
+        if (rec == NULL) {
+            return;
+        }
+        rec->a = g->npits;
+        memcpy(rec->pits, p->pits, sizeof(int) * (g->npits + 1));
+        end_record();
+    }
+}
+
+/*
+ * Return the next free record of this shard filled with event, or NULL if
+ * level is too low or the ring is full. Never blocks. The record is only
+ * seen by the logger thread once the caller is done with end_record().
+ */
+struct log_record *start_record(int level, int event, struct game *g, const char *name) {
+    if (level < log_level) {
+        return NULL;
+    }
+    unsigned int head = logs->head;
+    if (head - __atomic_load_n(&logs->tail, __ATOMIC_ACQUIRE) == LOGSIZE) {
+        add_count(LOG_DROPS, 1);
+        return NULL;
+    }
+
+    struct log_record *rec = &logs->records[head & (LOGSIZE - 1)];
+    rec->event = event;
+    rec->game = (g != NULL) ? g->id : 0;
+    if (name != NULL) {
+        strncpy(rec->name, name, MAXNAME);
+        rec->name[MAXNAME] = '\0';
+    } else {
+        rec->name[0] = '\0';
+    }
+    return rec;
+}
+
+/*
+ * Hand the record returned by start_record() to the logger thread.
+ */
+void end_record() {
+    __atomic_store_n(&logs->head, logs->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the log records of all shards to stdout, in its own thread. Only
+ * this thread may block on stdout, it polls the rings when they are idle.
+ */
+void *run_logger(void *arg) {
+    struct timespec idle = { 0, 1000000 };
+
+    while (1) {
+        int n = 0;
+        for (int i = 0; i < nthreads; i++) {
+            n += drain_log(&alllogs[i], stdout);
+        }
+        if (n == 0) {
+            fflush(stdout);
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Write all the records in ring r to out, return how many there were.
+ */
+int drain_log(struct log_ring *r, FILE *out) {
+    unsigned int tail = r->tail;
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (unsigned int i = tail; i != head; i++) {
+        write_record(&r->records[i & (LOGSIZE - 1)], out);
+    }
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    return head - tail;
+}
+
+/*
+ * Format the log record rec as the line the server used to print.
+ */
+void write_record(struct log_record *rec, FILE *out) {
+    switch (rec->event) {
+        case EV_CONNECT:
+            fputs(REQUIRE_CONNECT, out);
+            break;
+        case EV_INVALID_NAME:
+            fputs(INVALID_NAME_DISCONNECT, out);
+            break;
+        case EV_JOIN:
+            fprintf(out, "Player %s is joining in.\n", rec->name);
+            break;
+        case EV_MOVE:
+            fprintf(out, "Player %s distributes %d pebble(s) in pit index %d.\n", rec->name, rec->a, rec->b);
+            break;
+        case EV_TURN:
+            fprintf(out, "It is %s's move.\n", rec->name);
+            break;
+        case EV_BOARD:
+            fprintf(out, "%s:", rec->name);
+            for (int i = 0; i < rec->a; i++) {
+                fprintf(out, " [%d]%d", i, rec->pits[i]);
+            }
+            fprintf(out, " [end pit]%d\r\n", rec->pits[rec->a]);
+            break;
+        case EV_DISCONNECT:
+            fprintf(out, "Player %s disconnected.\n", rec->name);
+            break;
+        case EV_BEHIND:
+            fprintf(out, "Player %s is too far behind.\n", rec->name);
+            break;
+        case EV_GAME_START:
+            fprintf(out, "Game %d starts.\n", rec->game);
+            break;
+        case EV_GAME_OVER:
+            fprintf(out, "Game over!\n");
+            break;
+        case EV_POINTS:
+            fprintf(out, "%s has %d points\n", rec->name, rec->a);
+            break;
+        case EV_GAME_END:
+            fprintf(out, "Game %d ends.\n", rec->game);
+            break;
+        case EV_NAME_TIMEOUT:
+            fprintf(out, "Disconnect a player who sent no name in time.\n");
+            break;
+        case EV_MOVE_TIMEOUT:
+            fprintf(out, "Player %s did not move in time.\n", rec->name);
+            break;
+        case EV_WRITE_TIMEOUT:
+            fprintf(out, "Player %s stopped reading.\n", rec->name);
+            break;
+        case EV_REFUSED:
+            fprintf(out, "Refuse a connection: %s.\n", strerror(rec->a));
+            break;
+        case EV_REJOIN:
+            fprintf(out, "Player %s is back.\n", rec->name);
+            break;
+        case EV_RESTORE:
+            fprintf(out, "Restore %d game(s) with %d player(s).\n", rec->a, rec->b);
+            break;
+        case EV_SNAPSHOT_ERROR:
+            fprintf(out, "Snapshot failed: %s.\n", strerror(rec->a));
+            break;
+        case EV_JOURNAL_ERROR:
+            fprintf(out, "Journal write failed: %s.\n", strerror(rec->a));
+            break;
+        case EV_WATCH:
+            if (rec->game == 0) {
+                fprintf(out, "A spectator waits for a game.\n");
+            } else {
+                fprintf(out, "A spectator watches game %d.\n", rec->game);
+            }
+            break;
+    }
+}
+
+void init_timer(struct timer *t, int kind, void *owner) {
+    t->kind = kind;
+    t->owner = owner;
+    t->pprev = NULL;
+}
+
+/*
+ * Start timer t to fire in seconds, unless seconds is 0 (no limit).
+ * t must not be pending.
+ */
+void add_timer(struct timer *t, int seconds) {
+    add_timer_ms(t, seconds * 1000LL);
+}
+
+/*
+ * Start timer t to fire in ms milliseconds, rounded up to a tick, unless ms is 0.
+ */
+void add_timer_ms(struct timer *t, long long ms) {
+    if (ms <= 0) {
+        return;
+    }
+    t->expires = now_tick() + (ms * 1000000 + TICK_NS - 1) / TICK_NS;
+    if (t->expires <= wheel_tick) {
+        t->expires = wheel_tick + 1;
+    }
+    place_timer(t);
+    ntimers++;
+}
+
+/*
+ * Link timer t into the slot of the wheel matching its distance from wheel_tick.
+ */
+void place_timer(struct timer *t) {
+    long long delta = t->expires - wheel_tick;
+    struct timer **slot;
+    if (delta < WHEELSIZE) {
+        slot = &wheel[0][t->expires & (WHEELSIZE - 1)];
+    } else if (delta < (long long)WHEELSIZE * WHEELSIZE) {
+        slot = &wheel[1][(t->expires >> WHEELBITS) & (WHEELSIZE - 1)];
+    } else {    // too far out, wait in the slot cascaded last
+        slot = &wheel[1][((wheel_tick >> WHEELBITS) - 1) & (WHEELSIZE - 1)];
+    }
+
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+/*
+ * Stop timer t if it is pending.
+ */
+void remove_timer(struct timer *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    ntimers--;
+}
+
+/*
+ * Return the current tick of the timer wheel.
+ */
+long long now_tick() {
+    return now_ns() / TICK_NS;
+}
+
+/*
+ * Fire every timer due by now, cascading level 1 into level 0 on the way.
+ * A timer is unlinked before it fires, so it may be restarted by its action.
+ */
+void run_timers() {
+    long long now = now_tick();
+    while (ntimers > 0 && wheel_tick < now) {
+        wheel_tick++;
+        if ((wheel_tick & (WHEELSIZE - 1)) == 0) {
+            struct timer **slot = &wheel[1][(wheel_tick >> WHEELBITS) & (WHEELSIZE - 1)];
+            struct timer *t = *slot;
+            *slot = NULL;
+            while (t != NULL) {
+                struct timer *next = t->next;
+                place_timer(t);
+                t = next;
+            }
+        }
+
+        struct timer **slot = &wheel[0][wheel_tick & (WHEELSIZE - 1)];
+        while (*slot != NULL) {
+            struct timer *t = *slot;
+            remove_timer(t);
+            fire_timer(t);
+        }
+    }
+    wheel_tick = now;
+}
+
+/*
+ * Act on the expired timer t.
+ */
+void fire_timer(struct timer *t) {
+    add_count(TIMEOUTS, 1);
+    if (t->kind == TIMER_NAME) {
+        struct player *p = t->owner;
+        if (p->fd == -1) {  // a restored seat nobody came back for
+            announce_disconnect(p);
+        } else {    // never sent a name, free the slot
+            log_event(LOG_INFO, EV_NAME_TIMEOUT, NULL, NULL, 0, 0);
+            disconnect(p);
+        }
+    } else if (t->kind == TIMER_BOT) {  // the bot plays the best move found in time
+        struct game *g = t->owner;
+        struct player *p = get_current_player(g);
+        long nodes;
+        int pit = stop_job(g->job, &nodes);
+        struct player *bot = g->job->player;
+        release_job(g->job);
+        g->job = NULL;
+        add_count(BOT_NODES, nodes);
+        if (p != bot) {     // the turn was skipped meanwhile
+            if (p != NULL && p->bot == 1) {
+                think(g);
+            }
+        } else {
+            add_count(BOT_MOVES, 1);
+            for (int i = 0; i < g->npits && p->pits[pit] == 0; i++) {
+                pit = i;    // the board changed under the search
+            }
+            play_move(p, pit);
+        }
+    } else if (t->kind == TIMER_VIEW) {
+        // nothing to do, the end of this loop iteration sends the views
+    } else if (t->kind == TIMER_SNAPSHOT) {
+        take_snapshot();
+        add_timer(&snapshot_timer, snapshot_interval);
+    } else if (t->kind == TIMER_MOVE) { // skip the turn of the current player
+        struct game *g = t->owner;
+        struct player *p = get_current_player(g);
+        log_event(LOG_INFO, EV_MOVE_TIMEOUT, g, p->name, 0, 0);
+        queue_message(p, timeout_msg);
+        g->current = get_next_player(p);
+        journal_event(g, J_CURRENT, g->current->seat, 0, 0);
+        announce_turn(g);
+    } else if (t->kind == TIMER_WRITE) {    // stopped reading, drop it like a lagging client
+        struct player *p = t->owner;
+        log_event(LOG_WARN, EV_WRITE_TIMEOUT, p->game, p->name, 0, 0);
+        p->lagging = 1;
+        drop_output(p);
+        mark_dirty(p);
+    }
+}
+
+/*
+ * Return the milliseconds until the next timer is due, at most one level 0
+ * lap ahead, or -1 if no timer is pending.
+ */
+int next_timeout() {
+    if (watchdirty != NULL) {
+        return 0;   // spectators are still waiting for their output
+    }
+    if (ntimers == 0) {
+        return -1;
+    }
+    long long now = now_tick();
+    long long tick;
+    for (tick = wheel_tick + 1; tick < wheel_tick + WHEELSIZE; tick++) {
+        // stop at the first timer, or where level 1 cascades
+        if ((tick & (WHEELSIZE - 1)) == 0 || wheel[0][tick & (WHEELSIZE - 1)] != NULL) {
+            break;
+        }
+    }
+    if (tick <= now) {
+        return 0;
+    }
+    return (tick - now) * (TICK_NS / 1000000);
+}
+
+/*
+ * Copy every game of this shard into a snapshot and hand it to a writer
+ * thread, unless the previous one is still being written.
+ */
+void take_snapshot() {
+    if (__atomic_load_n(&snapshot_busy, __ATOMIC_ACQUIRE) == 1) {
+        return;
+    }
+
+    int ngames = 0, nplayers = 0;
+    for (struct game *g = gamelist; g; g = g->next) {
+        ngames++;
+        nplayers += g->nplayers;
+    }
+    size_t len = sizeof(struct snapshot_header) + ngames * sizeof(struct snapshot_game)
+                 + nplayers * sizeof(struct snapshot_seat);
+    struct snapshot_job *job = malloc(sizeof(struct snapshot_job));
+    if (job == NULL || (job->buf = calloc(1, len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    struct snapshot_header *h = (struct snapshot_header *)job->buf;
+    h->magic = SNAPSHOT_MAGIC;
+    h->version = SNAPSHOT_VERSION;
+    h->npits = MAXPITS;
+    h->maxname = MAXNAME;
+    h->ngames = ngames;
+    char *pos = job->buf + sizeof(struct snapshot_header);
+    for (struct game *g = gamelist; g; g = g->next) {
+        struct snapshot_game *sg = (struct snapshot_game *)pos;
+        sg->npits = g->npits;
+        sg->npebbles = g->npebbles;
+        sg->nplayers = g->nplayers;
+        sg->current = -1;
+        pos += sizeof(struct snapshot_game);
+
+        int i = 0;
+        for (struct player *p = g->playerlist; p; p = p->next, i++) {
+            struct snapshot_seat *seat = (struct snapshot_seat *)pos;
+            memcpy(seat->pits, p->pits, sizeof(int) * (g->npits + 1));
+            memcpy(seat->name, p->name, MAXNAME + 1);
+            seat->bot = p->bot;
+            if (p == g->current) {
+                sg->current = i;
+            }
+            pos += sizeof(struct snapshot_seat);
+        }
+    }
+
+    job->len = len;
+    snprintf(job->path, sizeof(job->path), "%s", snapshot_file);
+    job->busy = &snapshot_busy;
+    snapshot_busy = 1;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create(&tid, &attr, write_snapshot, job)) != 0) {
+        log_event(LOG_WARN, EV_SNAPSHOT_ERROR, NULL, NULL, errno, 0);
+        snapshot_busy = 0;
+        free(job->buf);
+        free(job);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Write the snapshot job to a temporary file and rename it over the last
+ * snapshot, so a crash never leaves a partial one. Runs in its own thread.
+ */
+void *write_snapshot(void *arg) {
+    struct snapshot_job *job = arg;
+    char tmp[sizeof(job->path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("snapshot: open");
+    } else {
+        size_t written = 0;
+        while (written < job->len) {
+            ssize_t n = write(fd, job->buf + written, job->len - written);
+            if (n == -1 && errno != EINTR) {
+                perror("snapshot: write");
+                break;
+            }
+            written += (n > 0) ? n : 0;
+        }
+        if (written == job->len && fsync(fd) == 0 && close(fd) == 0) {
+            if (rename(tmp, job->path) == -1) {
+                perror("snapshot: rename");
+            }
+        } else {
+            close(fd);
+        }
+    }
+
+    __atomic_store_n(job->busy, 0, __ATOMIC_RELEASE);
+    free(job->buf);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Seat the games of the snapshot file of this shard again, if there is one.
+ * Every seat waits name_timeout seconds for its player to send the same name.
+ * The file is checked like a journal replay checks its records: the first
+ * game that could not have been saved by this server ends the restore.
+ */
+void restore_snapshot() {
+    int fd = open(snapshot_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;     // nothing saved yet
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("snapshot: mmap");
+        return;
+    }
+
+    struct snapshot_header *h = (struct snapshot_header *)map;
+    char *end = map + st.st_size;
+    char *pos = map + sizeof(struct snapshot_header);
+    int ngames = 0, nplayers = 0;
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION
+        || h->npits != MAXPITS || h->maxname != MAXNAME) {
+        fprintf(stderr, "server: %s is not a snapshot of this server\n", snapshot_file);
+        h->ngames = 0;
+    }
+    for (int n = 0; n < h->ngames; n++) {
+        if (end - pos < (long)sizeof(struct snapshot_game)) {
+            break;  // truncated
+        }
+        struct snapshot_game *sg = (struct snapshot_game *)pos;
+        pos += sizeof(struct snapshot_game);
+        if (sg->nplayers <= 0 || (end - pos) / (long)sizeof(struct snapshot_seat) < sg->nplayers
+            || (max_seats != 0 && sg->nplayers > max_seats)
+            || sg->npits < 1 || sg->npits > MAXPITS || sg->npebbles < 1 || sg->npebbles > MAXPEBBLES
+            || sg->current < -1 || sg->current >= sg->nplayers) {
+            fprintf(stderr, "server: %s is corrupt after %d game(s)\n", snapshot_file, ngames);
+            break;
+        }
+        struct snapshot_seat *seats = (struct snapshot_seat *)pos;
+        pos += sg->nplayers * sizeof(struct snapshot_seat);
+        if (check_seats(seats, sg->nplayers, sg->npits) == -1) {
+            fprintf(stderr, "server: %s is corrupt after %d game(s)\n", snapshot_file, ngames);
+            break;
+        }
+
+        // seat the oldest player first, every seat goes to the head of playerlist
+        struct game *g = new_game(sg->npits, sg->npebbles);
+        for (int i = sg->nplayers - 1; i >= 0; i--) {
+            initialize_player(-1);
+            struct player *p = lobby;
+            strncpy(p->name, seats[i].name, MAXNAME);
+            p->name[MAXNAME] = '\0';
+            // corrupt if a name is seated twice, and without -B nobody plays for a bot
+            if (find_name(p->name) != NULL || (seats[i].bot == 1 && bot_players == 0)) {
+                leave_lobby(p);
+                close_player(p);
+                continue;
+            }
+            if (seats[i].bot == 1) {    // a bot does not wait for a client
+                p->bot = 1;
+                remove_timer(&p->name_timer);
+            }
+            p->wait_for_username = 0;
+            add_name(p);
+            seat_player(p, g);
+
+            for (int j = 0; j <= g->npits; j++) {
+                set_pit(p, j, seats[i].pits[j]);
+                journal_event(g, J_PIT, p->seat, j, seats[i].pits[j]);
+            }
+            if (i == sg->current) {
+                g->current = p;
+            }
+            nplayers++;
+        }
+        if (g->playerlist == NULL) {
+            free_game(g);
+            continue;
+        }
+        if (g->current == NULL) {
+            g->current = g->playerlist;
+        }
+        journal_event(g, J_CURRENT, g->current->seat, 0, 0);
+        if (g->current->bot == 1) {
+            announce_turn(g);   // the bot searches its move right away
+        }
+        ngames++;
+    }
+    munmap(map, st.st_size);
+    log_event(LOG_INFO, EV_RESTORE, NULL, NULL, ngames, nplayers);
+}
+
+/*
+ * Check the n seats of a snapshot game of npits pits: a valid name, and
+ * pits that are never negative and whose sum the int arithmetic of the
+ * game can hold, whatever the joins and leaves made it grow to.
+ * Return 0 if they are valid, -1 otherwise.
+ */
+int check_seats(struct snapshot_seat *seats, int n, int npits) {
+    long total = 0;
+    for (int i = 0; i < n; i++) {
+        int len = strnlen(seats[i].name, MAXNAME + 1);
+        if (len == 0 || len > MAXNAME || seats[i].bot < 0 || seats[i].bot > 1) {
+            return -1;
+        }
+        for (int j = 0; j <= npits; j++) {
+            if (seats[i].pits[j] < 0 || seats[i].pits[j] > INT_MAX / 2) {
+                return -1;
+            }
+            total += seats[i].pits[j];
+        }
+    }
+    return (total > INT_MAX / 2) ? -1 : 0;
+}
+
+/*
+ * Put the name of the journal file of shard in file: journal_path itself,
+ * or journal_path.N with several shards.
+ */
+void journal_file(char *file, int size, int shard) {
+    if (nthreads == 1) {
+        snprintf(file, size, "%s", journal_path);
+    } else {
+        snprintf(file, size, "%s.%d", journal_path, shard);
+    }
+}
+
+/*
+ * Open the journal file of this shard for appending and mark the start of
+ * this run.
+ */
+void open_journal(int shard) {
+    char file[256];
+    journal_file(file, sizeof(file), shard);
+    if ((journal_fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        perror("journal: open");
+        exit(1);
+    }
+    journal_event(NULL, J_START, 0, 0, MAXPITS);
+}
+
+/*
+ * Number the games of this run after every game already in the journals,
+ * so an id names one game even in a journal of several runs. Ids only grow,
+ * so each file is read backwards, down to the last run that had a game.
+ */
+void resume_game_ids() {
+    int last = 0;
+    for (int shard = 0; shard < nthreads; shard++) {
+        char file[256];
+        journal_file(file, sizeof(file), shard);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct journal_record)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;   // a new journal
+        }
+        struct journal_record *records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (records == MAP_FAILED) {
+            perror("journal: mmap");
+            exit(1);
+        }
+
+        int found = 0;
+        for (long i = st.st_size / sizeof(struct journal_record) - 1; i >= 0; i--) {
+            if (records[i].event == J_START && found > 0) {
+                break;  // the earlier runs numbered their games below this one
+            }
+            if (records[i].game > found) {
+                found = records[i].game;
+            }
+        }
+        munmap(records, st.st_size);
+        last = (found > last) ? found : last;
+    }
+    next_game_id = last + 1;
+}
+
+/*
+ * Add a record to the journal batch of this shard, written by flush_journal()
+ * at the end of the loop iteration, or now if the batch is full.
+ */
+void journal_event(struct game *g, int event, int row, int pit, int value) {
+    if (journal_fd == -1) {
+        return;
+    }
+    struct journal_record *rec = &journal[njournal++];
+    rec->game = (g != NULL) ? g->id : 0;
+    rec->event = event;
+    rec->pit = pit;
+    rec->row = row;
+    rec->value = value;
+    if (njournal == JOURNALBATCH) {
+        flush_journal();
+    }
+}
+
+/*
+ * Append the journal batch of this shard to its file with one write.
+ * A batch that cannot be written is lost, the server goes on without it.
+ */
+void flush_journal() {
+    size_t len = njournal * sizeof(struct journal_record);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(journal_fd, (char *)journal + written, len - written);
+        add_count(SYSCALLS, 1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_event(LOG_WARN, EV_JOURNAL_ERROR, NULL, NULL, errno, 0);
+            break;
+        }
+        written += n;
+    }
+    njournal = 0;
+}
+
+/*
+ * Replay the journal replay_path: map it and run every record through the
+ * same functions as the server, without sockets, names or timers. The boards
+ * of game replay_game are printed when it ends and at the end of the journal.
+ */
+void replay_journal() {
+    stats = &allstats[0];
+    logs = &alllogs[0];
+    log_level = LOG_OFF;
+    name_timeout = 0;
+    max_seats = 0;
+
+    int fd = open(replay_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("replay: open");
+        exit(1);
+    }
+    long nrecords = st.st_size / sizeof(struct journal_record);
+    struct journal_record *records = NULL;
+    if (nrecords > 0) {
+        records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (records == MAP_FAILED) {
+            perror("replay: mmap");
+            exit(1);
+        }
+        madvise(records, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    struct game **games = NULL; // the live games indexed by id
+    int ngames = 0;
+    long moves = 0, mismatches = 0;
+    long long start = now_ns();
+    for (long i = 0; i < nrecords; i++) {
+        struct journal_record *rec = &records[i];
+        if (rec->event == J_START) {
+            if (rec->value != MAXPITS) {
+                fprintf(stderr, "replay: %s is not a journal of this server\n", replay_path);
+                exit(1);
+            }
+            // the server restarted, the games of its last run are gone
+            while (gamelist != NULL) {
+                if (gamelist->id == replay_game) {
+                    print_board(gamelist);
+                }
+                games[gamelist->id] = NULL;
+                end_game(gamelist);
+            }
+            pool_players();
+            continue;
+        }
+        if (rec->game <= 0) {
+            mismatches++;
+            continue;
+        }
+        if (rec->game >= ngames) {
+            int n = (rec->game < 2 * ngames) ? 2 * ngames : rec->game + 1;
+            if ((games = realloc(games, sizeof(struct game *) * n)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            memset(games + ngames, 0, sizeof(struct game *) * (n - ngames));
+            ngames = n;
+        }
+
+        struct game *g = games[rec->game];
+        if (rec->event == J_JOIN) {
+            if (g == NULL && rec->pit >= 1 && rec->pit <= MAXPITS) {
+                g = new_game(rec->pit, rec->value);
+                g->id = rec->game;
+                games[rec->game] = g;
+            }
+            if (g == NULL || rec->row != g->nplayers || rec->pit != g->npits) {
+                mismatches++;
+                continue;
+            }
+            initialize_player(-1);
+            struct player *p = lobby;
+            p->wait_for_username = 0;
+            p->name[0] = '\0';
+            seat_player(p, g);
+            mismatches += (p->pits[0] != rec->value);
+            continue;
+        }
+        if (g == NULL || rec->row < 0 || rec->row >= g->nplayers || rec->pit < 0 || rec->pit > g->npits) {
+            mismatches++;
+            continue;
+        }
+
+        struct player *p = g->seats[rec->row];
+        switch (rec->event) {
+            case J_MOVE:
+                if (rec->pit == g->npits || p != g->current || p->pits[rec->pit] != rec->value) {
+                    mismatches++;
+                    break;
+                }
+                turn_game(p, rec->pit);
+                moves++;
+                break;
+            case J_CURRENT:
+                g->current = p;
+                break;
+            case J_PIT:
+                set_pit(p, rec->pit, rec->value);
+                break;
+            case J_LEAVE:
+                if (g->id == replay_game && g->playerlist == p && p->next == NULL) {
+                    print_board(g); // the last player leaves, no J_END follows
+                }
+                disconnect(p);
+                if (g->playerlist == NULL) {
+                    games[rec->game] = NULL;
+                    free_game(g);
+                }
+                pool_players();
+                break;
+            case J_END:
+                if (g->id == replay_game) {
+                    print_board(g);
+                }
+                games[rec->game] = NULL;
+                end_game(g);
+                pool_players();
+                break;
+            default:
+                mismatches++;
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    if (replay_game > 0 && replay_game < ngames && games[replay_game] != NULL) {
+        print_board(games[replay_game]);
+    }
+    printf("Replayed %ld record(s), %ld move(s) in %.3fs, %.0f moves/s, %ld mismatch(es).\n",
+           nrecords, moves, secs, (secs > 0) ? moves / secs : 0.0, mismatches);
+}
+
+/*
+ * Print the board of game g rebuilt by the replay, one line per row.
+ */
+void print_board(struct game *g) {
+    printf("Game %d:\n", g->id);
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        printf("seat %d%s:", p->seat, (p == g->current) ? " (current)" : "");
+        for (int i = 0; i < g->npits; i++) {
+            printf(" [%d]%d", i, p->pits[i]);
+        }
+        printf(" [end pit]%d\n", p->pits[g->npits]);
+    }
+}
+
+/*
+ * Seat potential player p on a board of the size in arg, " PITSxPEBBLES",
+ * once it sends its name.
+ */
+void choose_board(struct player *p, const char *arg) {
+    int npits, npebbles;
+    if (sscanf(arg, " %dx%d", &npits, &npebbles) != 2
+        || npits < 1 || npits > MAXPITS || npebbles < 1 || npebbles > MAXPEBBLES) {
+        queue_message(p, invalid_board_msg);
+        return;
+    }
+    p->npits = npits;
+    p->npebbles = npebbles;
+
+    char reply[MAXMESSAGE];
+    snprintf(reply, sizeof(reply), "Board of %d pits of %d pebbles. What is your name?\r\n", npits, npebbles);
+    struct message *m = new_message(reply, strlen(reply) + 1);
+    queue_message(p, m);
+    release_message(m);
+}
+
+/*
+ * Make potential player p, who sent /watch instead of a name, a spectator
+ * of game id, or of the newest game if id is 0, then of the newest game
+ * after it each time it ends, waiting in the idlewatchers while there is
+ * none. A spectator has no seat: it only gets the view of the board fed
+ * by feed_watchers().
+ */
+void watch_game(struct player *p, int id) {
+    struct game *g = gamelist;
+    while (id != 0 && g != NULL && g->id != id) {
+        g = g->next;
+    }
+    if (id != 0 && g == NULL) {
+        queue_message(p, no_game_msg);
+        return;
+    }
+
+    leave_lobby(p);
+    p->wait_for_username = 0;
+    p->watching = 1;
+    p->follow = (id == 0);
+    p->name[0] = '\0';
+    remove_timer(&p->name_timer);
+    link_watcher(p, g);
+    log_event(LOG_INFO, EV_WATCH, g, NULL, 0, 0);
+}
+
+/*
+ * Remove spectator p from the watchers of its game and close it.
+ */
+void stop_watching(struct player *p) {
+    unlink_watcher(p);
+    p->disconnect = 1;
+    close_player(p);
+}
+
+/*
+ * Add spectator p to the watchers of game g, it gets the next view,
+ * or to the idlewatchers if g is NULL.
+ */
+void link_watcher(struct player *p, struct game *g) {
+    struct player **list = (g != NULL) ? &g->watchers : &idlewatchers;
+    p->game = g;
+    p->front = NULL;
+    p->next = *list;
+    if (*list != NULL) {
+        (*list)->front = p;
+    }
+    *list = p;
+    if (g != NULL) {
+        g->nwatchers++;
+        mark_viewed(g);
+    }
+}
+
+/*
+ * Remove spectator p from the watchers of its game, or from the idlewatchers.
+ */
+void unlink_watcher(struct player *p) {
+    struct game *g = p->game;
+    struct player **list = (g != NULL) ? &g->watchers : &idlewatchers;
+    if (p->front != NULL) {
+        p->front->next = p->next;
+    } else {
+        *list = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->front = p->front;
+    }
+    if (g != NULL) {
+        g->nwatchers--;
+    }
+    p->stale = 0;
+    p->game = NULL;
+}
+
+/*
+ * Add the watched game g to the viewlist, its spectators get the new board
+ * once every view_interval ms at most, however often it changed.
+ */
+void mark_viewed(struct game *g) {
+    if (g->viewed == 0) {
+        g->viewed = 1;
+        g->next_viewed = viewlist;
+        viewlist = g;
+    }
+}
+
+/*
+ * Send the board of every game in the viewlist to its spectators, one
+ * message shared by all of them. A spectator still sending an older view
+ * is not queued more, it gets the latest view once it caught up.
+ */
+void feed_watchers() {
+    while (viewlist) {
+        struct game *g = viewlist;
+        viewlist = g->next_viewed;
+        g->viewed = 0;
+
+        if (g->view != NULL) {
+            release_message(g->view);
+        }
+        g->view = view_message(g);
+        add_count(VIEWS, 1);
+        for (struct player *w = g->watchers; w; w = w->next) {
+            if (w->binary == 1 && g->view->frame == NULL) {
+                g->view->frame = view_frame(g); // binary spectators get the board packed
+            }
+            if (w->outlen == 0) {
+                queue_message(w, g->view);
+            } else {
+                w->stale = 1;
+                add_count(CONFLATED, 1);
+            }
+        }
+    }
+}
+
+/*
+ * Return the view of game g for its spectators: the board, then whose
+ * move it is, or that the game is over.
+ */
+struct message *view_message(struct game *g) {
+    struct message *m = new_message(NULL, BOARDLINE(g->npits) * get_number_players(g) + 2 * MAXMESSAGE + 1);
+    int len = sprintf(m->data, "Game %d:\r\n", g->id);
+    len += format_board(g, m->data + len);
+    len += format_status(g, m->data + len);
+    m->len = len + 1;
+    return m;
+}
+
+/*
+ * Write whose move it is in game g, or that the game is over, as text
+ * into buf. Return its length, 0 if there is nothing to say.
+ */
+int format_status(struct game *g, char *buf) {
+    struct player *current_player = get_current_player(g);
+    buf[0] = '\0';
+    if (game_is_over(g)) {
+        return sprintf(buf, "Game over!\r\n");
+    } else if (current_player != NULL) {
+        return sprintf(buf, "It is %s's move\r\n", current_player->name);
+    }
+    return 0;
+}
+
+/*
+ * Return the view of game g for binary spectators: a FRAME_STATE of the
+ * board, then the status of view_message() as a FRAME_TEXT, in one message.
+ */
+struct message *view_frame(struct game *g) {
+    char status[MAXMESSAGE];
+    int n = format_status(g, status);
+    struct message *state = state_frame(g);
+    if (n == 0) {
+        return state;
+    }
+
+    struct message *m = new_message(NULL, state->len + FRAME_HEADER + n);
+    memcpy(m->data, state->data, state->len);
+    put_header(m->data + state->len, FRAME_TEXT, n);
+    memcpy(m->data + state->len + FRAME_HEADER, status, n);
+    m->len = state->len + FRAME_HEADER + n;
+    release_message(state);
+    return m;
+}
+
+/*
+ * Send the last view of game g, which is about to end, to its spectators
+ * who caught up, or to all of them that every player left. Those following
+ * the newest game move on to the newest other game, or wait for the next
+ * one, the others are closed.
+ */
+void release_watchers(struct game *g) {
+    if (g->viewed == 1) {
+        struct game **prev = &viewlist;
+        while (*prev != g) {
+            prev = &(*prev)->next_viewed;
+        }
+        *prev = g->next_viewed;
+        g->viewed = 0;
+    }
+    if (g->view != NULL) {
+        release_message(g->view);
+        g->view = NULL;
+    }
+    if (g->watchers == NULL) {
+        return;
+    }
+
+    struct message *m;
+    if (g->playerlist != NULL) {
+        m = view_message(g);
+    } else {    // no board left to show
+        m = new_message(NULL, MAXMESSAGE);
+        m->len = sprintf(m->data, "Game %d ends, every player left.\r\n", g->id) + 1;
+    }
+    struct game *newest = (gamelist != g) ? gamelist : g->next;
+    struct player *next;
+    for (struct player *w = g->watchers; w; w = next) {
+        next = w->next;
+        if (g->playerlist == NULL || w->outlen == 0) {
+            if (w->binary == 1 && m->frame == NULL && g->playerlist != NULL) {
+                m->frame = view_frame(g);
+            }
+            queue_message(w, m);
+        }
+        if (w->follow == 1) {   // to the idlewatchers if there is no other game
+            unlink_watcher(w);
+            link_watcher(w, newest);
+        } else {
+            stop_watching(w);
+        }
+    }
+    release_message(m);
+}
+
+/*
+ * Seat bots in game g until it has bot_players players, as long as a player
+ * who is not a bot is seated. Without one, the bots leave too.
+ * Return 1 if bots were seated and the new game state sent, 0 otherwise.
+ */
+int fill_seats(struct game *g) {
+    if (bot_players == 0) {
+        return 0;
+    }
+    int humans = 0;
+    for (struct player *p = g->playerlist; p; p = p->next) {
+        humans += (p->bot == 0);
+    }
+    if (humans == 0) {
+        while (g->playerlist != NULL) {
+            disconnect(g->playerlist);
+        }
+        return 0;
+    }
+
+    int seated = 0;
+    while (get_number_players(g) < bot_players
+           && (max_seats == 0 || get_number_players(g) < max_seats)) {
+        seat_bot(g);
+        seated++;
+    }
+    if (seated > 0 && g->current != NULL) {
+        display_game_state(g);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Seat a new bot in game g.
+ */
+void seat_bot(struct game *g) {
+    char announce[MAXMESSAGE];
+
+    initialize_player(-1);
+    struct player *p = lobby;
+    remove_timer(&p->name_timer);
+    p->bot = 1;
+    p->wait_for_username = 0;
+    do {    // a name nobody of this shard uses
+        snprintf(p->name, MAXNAME + 1, "bot%d", ++nbots);
+    } while (find_name(p->name) != NULL);
+    add_name(p);
+    seat_player(p, g);
+
+    sprintf(announce, "Player %s is joining in.\r\n", p->name);
+    broadcast(g, announce, NULL);
+    log_event(LOG_INFO, EV_JOIN, g, p->name, 0, 0);
+}
+
+/*
+ * Start the search for the move of the bot whose turn it is in game g,
+ * it plays once bot_timer fires. The event loop never waits for it.
+ */
+void think(struct game *g) {
+    struct player *bot = get_current_player(g);
+    cancel_job(g);
+    g->job = start_job(g->board, g->nplayers, g->npits, bot->seat);
+    g->job->player = bot;
+    add_timer_ms(&g->bot_timer, bot_ms);
+}
+
+/*
+ * Stop the search of game g, if there is one, and forget it.
+ */
+void cancel_job(struct game *g) {
+    remove_timer(&g->bot_timer);
+    if (g->job != NULL) {
+        long nodes;
+        stop_job(g->job, &nodes);
+        add_count(BOT_NODES, nodes);
+        release_job(g->job);
+        g->job = NULL;
+    }
+}
 
-int main(int argc, char **argv) {
-    char msg[MAXMESSAGE];
+/*
+ * Start searching the move of the player in row me of the nplayers rows of
+ * npits pits of board, for bot_ms at most. The caller holds one reference
+ * to the job.
+ */
+struct bot_job *start_job(int *board, int nplayers, int npits, int me) {
+    struct bot_job *job = malloc(sizeof(struct bot_job));
+    if (job == NULL || (job->board = malloc(sizeof(int) * (npits + 1) * nplayers)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(job->board, board, sizeof(int) * (npits + 1) * nplayers);
+    job->refs = 1;
+    job->stop = 0;
+    job->deadline = now_ns() + bot_ms * 1000000LL;
+    job->me = me;
+    job->nplayers = nplayers;
+    job->npits = npits;
+    job->player = NULL;
+    pthread_mutex_init(&job->lock, NULL);
+    job->depth = 0;
+    job->best = 0;
+    job->cand = -1;
+    job->depth_done = 0;
+    job->nodes = 0;
+    for (int i = npits - 1; i >= 0; i--) {  // until a search finishes, any legal pit
+        if (board[me * (npits + 1) + i] > 0) {
+            job->best = i;
+        }
+    }
 
-    parseargs(argc, argv);
-    makelistener();
+    push_depth(&workers[next_worker], job);
+    next_worker = (next_worker + 1) % nworkers;
+    return job;
+}
 
-    int max_fd = listenfd;
-    fd_set all_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(listenfd, &all_fds);
+/*
+ * Tell the workers to give up job. Return the best pit found, and the
+ * number of nodes searched so far in nodes.
+ */
+int stop_job(struct bot_job *job, long *nodes) {
+    __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&job->lock);
+    int best = job->best;
+    *nodes = job->nodes;
+    job->nodes = 0;
+    pthread_mutex_unlock(&job->lock);
+    return best;
+}
 
-    while (!game_is_over()) {
-        fd_set listen_fds = all_fds;
+/*
+ * Drop one reference to job, the last one frees it.
+ */
+void release_job(struct bot_job *job) {
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&job->lock);
+        free(job->board);
+        free(job);
+    }
+}
 
-        int nready = select(max_fd + 1, &listen_fds, NULL, NULL, NULL);
-        if (nready == -1) {
-            perror("server: select");
+/*
+ * Start the bot workers, bot_threads of them or one per CPU.
+ */
+void start_workers() {
+    nworkers = (bot_threads > 0) ? bot_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    if ((workers = calloc(nworkers, sizeof(struct bot_worker))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if ((errno = pthread_create(&workers[i].tid, NULL, run_worker, &workers[i])) != 0) {
+            perror("pthread_create");
             exit(1);
         }
+    }
+}
 
-        // new player requires connection
-        if (FD_ISSET(listenfd, &listen_fds)) {
-            int client_fd = accept_connection(listenfd);
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
+/*
+ * Run the tasks of bot worker w, its own newest first, then the oldest
+ * of the other workers. Sleep while there are none.
+ */
+void *run_worker(void *arg) {
+    struct bot_worker *w = arg;
+    while (1) {
+        struct bot_task *t = pop_task(w);
+        for (int i = 1; t == NULL && i < nworkers; i++) {
+            struct bot_worker *victim = &workers[(w->id + i) % nworkers];
+            pthread_mutex_lock(&victim->lock);
+            if ((t = victim->head) != NULL) {
+                victim->head = t->next;
+                if (victim->head != NULL) {
+                    victim->head->front = NULL;
+                } else {
+                    victim->tail = NULL;
+                }
             }
-            FD_SET(client_fd, &all_fds);
+            pthread_mutex_unlock(&victim->lock);
         }
 
-        char announce_new_player[MAXMESSAGE];
-        // for loop playerlist, check which players (or potential players) are active
-        for (struct player *p = playerlist; p; p = p->next) {
-            if (FD_ISSET(p->fd, &listen_fds)) { // current player is active
-                if (p->wait_for_username == 1) {    // wait to check valid username
-                    char buf[MAXNAME + 1] = {'\0'};
-                    int nbytes;
-
-                    nbytes = read(p->fd, &buf, (MAXNAME + 1 - p->inbuf));
-                    if (nbytes == 0) {
-                        disconnect_invalid_name(p->fd, all_fds);
-                    }
-                    p->inbuf += nbytes;
-
-                    if (p->inbuf < (MAXNAME + 1)) {
-                        strncat(p->name_buf, buf, strlen(buf) + 1);
-                    } else {    // invalid case1: the username is too long
-                        FD_CLR(p->fd, &all_fds);
-                        disconnect(p->fd);
-                        printf("%s", INVALID_NAME_DISCONNECT);
-                    }
-
-                    int newline = find_newline(p->name_buf, strlen(p->name_buf));
-                    if (newline != -1) {
-                        if (newline == 0) { // invalid case2: enter return immediately
-                            if (write(p->fd, INVALID, INVALID_SIZE) != INVALID_SIZE) {
-                                perror("Server: write");
-                                exit(1);
-                            }
-                            disconnect_invalid_name(p->fd, all_fds);
-                        } else {
-                            p->get_full_name = 1;
-                            p->name_buf[find_newline(p->name_buf, strlen(p->name_buf))] = '\0';
-                        }
-                    }
-
-                    if (p->get_full_name == 1) {
-                        // invalid case3: username already exists
-                        for (struct player* g = playerlist; g; g = g->next) {
-                            if ((g->wait_for_username == 0) &&
-                                strncmp(g->name, p->name_buf, strlen(p->name_buf) + 1) == 0) {
-                                if (write(p->fd, INVALID, INVALID_SIZE) != INVALID_SIZE) {
-                                    perror("Server: write");
-                                    exit(1);
-                                }
-                                disconnect_invalid_name(p->fd, all_fds);
-                            }
-                        }
-
-                        // Get valid name
-                        strncpy(p->name, p->name_buf, MAXNAME + 1);
-                        p->wait_for_username = 0;
-                    }
-
-                    if (p->wait_for_username == 0 && p->disconnect == 0)  {   // get valid name, add to the game
-                        sprintf(announce_new_player, "Player %s is joining in.\r\n", p->name);
-                        broadcast(announce_new_player, NULL);
-                        printf("Player %s is joining in.\n", p->name);
-
-                        // if this is the first player, begin the game immediately
-                        if (get_number_players() == 1) {
-                            p->play = 1;
-                        }
-
-                        // announce game state and prompt message to get next active fd
-                        display_game_state();
-                        struct player *current_player = get_current_player();
-                        if (current_player != NULL) {
-                            if (write(current_player->fd, MOVE, MOVE_SIZE) != MOVE_SIZE) {
-                                perror("Server: write");
-                                exit(1);
-                            }
-                            char announce[MAXMESSAGE + 1];
-                            sprintf(announce, "It is %s's move\r\n", current_player->name);
-                            broadcast(announce, current_player);
-                            printf("It is %s's move.\n", current_player->name);
-                        }
-                    }
-                } else {    // current player is already in the game
-                    if (p->play == 1) { // it is current player's turn to play
-                        // Call read_from which contains while loop, may potentially block other players.
-                        // By the handout, we only need to consider this situation in the read full name part
-                        char *read_number = read_from(p->fd);
-
-                        if (p->disconnect == 1) {    // current player disconnects when it is his turn to play
-                            get_next_player(p)->play = 1;
-
-                            FD_CLR(p->fd, &all_fds);
-                            char *disconnect_name = disconnect(p->fd);
-                            char announce_disconnect[MAXMESSAGE + 1];
-                            sprintf(announce_disconnect, "Player %s disconnected.\r\n", disconnect_name);
-                            broadcast(announce_disconnect, p);
-                            printf("Player %s disconnected.\n", disconnect_name);
-
-                            // announce new player in the game that it is his turn
-                            struct player *current_player = get_current_player();
-                            if (current_player != NULL) {
-                                if (write(current_player->fd, MOVE, MOVE_SIZE) != MOVE_SIZE) {
-                                    perror("Server: write");
-                                    exit(1);
-                                }
-                                char announce[MAXMESSAGE + 1];
-                                sprintf(announce, "It is %s's move\r\n", current_player->name);
-                                broadcast(announce, get_current_player());
-                                printf("It is %s's move.\n", current_player->name);
-                            }
-                        } else {    // current player in the game, check whether the index is valid
-                            if (strlen(read_number) == 0) { // enter nothing, return immediately
-                                if (write(p->fd, INVALID_PIT, INVALID_PIT_SIZE) != INVALID_PIT_SIZE) {
-                                    perror("Server: write");
-                                    exit(1);
-                                }
-                            } else {    // enter a number
-                                int potential_index = strtol(read_number, NULL, 0);
-
-                                if (potential_index < 0 ||
-                                    potential_index > (NPITS - 1)) {    // case1: pit index out of range
-                                    if (write(p->fd, INVALID_PIT, INVALID_PIT_SIZE) != INVALID_PIT_SIZE) {
-                                        perror("Server: write");
-                                        exit(1);
-                                    }
-                                } else {    // case2: pit index within range but with no pebble
-                                    if (p->pits[potential_index] == 0) {
-                                        if (write(p->fd, INVALID_PIT, INVALID_PIT_SIZE) != INVALID_PIT_SIZE) {
-                                            perror("Server: write");
-                                            exit(1);
-                                        }
-                                    } else {    // case3: it is the valid index
-                                        char announcement[MAXMESSAGE + 1];
-                                        sprintf(announcement, "Player %s distributes %d pebble(s) in pit index %d.\n\r",
-                                                p->name, p->pits[potential_index], potential_index);
-                                        broadcast(announcement, NULL);
-                                        printf("Player %s distributes %d pebble(s) in pit index %d.\n",
-                                               p->name, p->pits[potential_index], potential_index);
-
-                                        // play the game
-                                        turn_game(p, potential_index);
-
-                                        // announce game state and prompt message to get next active fd
-                                        display_game_state();
-                                        struct player *current_player = get_current_player();
-                                        if (current_player != NULL) {
-                                            if (write(current_player->fd, MOVE, MOVE_SIZE) != MOVE_SIZE) {
-                                                perror("Server: write");
-                                                exit(1);
-                                            }
-                                            char announce[MAXMESSAGE + 1];
-                                            sprintf(announce, "It is %s's move\r\n", current_player->name);
-                                            broadcast(announce, get_current_player());
-                                            printf("It is %s's move.\n", current_player->name);
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    } else {    // it is not current player's turn to play
-                        // Call read_from which contains while loop, may potentially block other players.
-                        // By the handout, we only need to consider this situation in the read full name part
-                        read_from(p->fd);   // Read out junk message.
-
-                        if (write(p->fd, NOT_MOVE, NOT_MOVE_SIZE) != NOT_MOVE_SIZE) {
-                            perror("Server: write");
-                            exit(1);
-                        }
-
-                        // Check disconnection
-                        if (p->disconnect == 1) {
-                            FD_CLR(p->fd, &all_fds);
-                            char *disconnect_name = disconnect(p->fd);
-                            char announce_disconnect[MAXMESSAGE + 1];
-                            sprintf(announce_disconnect, "Player %s disconnected.\r\n", disconnect_name);
-                            broadcast(announce_disconnect, p);
-                            printf("Player %s disconnected.\n", disconnect_name);
-                        }
-                    }
-                }
+        pthread_mutex_lock(&pool_lock);
+        if (t == NULL) {
+            while (nqueued == 0) {
+                pthread_cond_wait(&pool_cond, &pool_lock);
             }
+            pthread_mutex_unlock(&pool_lock);
+            continue;
         }
+        nqueued--;
+        pthread_mutex_unlock(&pool_lock);
+
+        struct bot_job *job = t->job;
+        run_task(w, t);
+        release_job(job);
     }
-    broadcast("Game over!\r\n", NULL);
-    printf("Game over!\n");
-    for (struct player *p = playerlist; p; p = p->next) {
-        int points = 0;
-        for (int i = 0; i <= NPITS; i++) {
-            points += p->pits[i];
-        }
-        printf("%s has %d points\n", p->name, points);
-        snprintf(msg, MAXMESSAGE, "%s has %d points\r\n", p->name, points);
-        broadcast(msg, NULL);
+    return NULL;
+}
+
+/*
+ * Put task t at the back of the deque of worker w and wake a worker up.
+ */
+void push_task(struct bot_worker *w, struct bot_task *t) {
+    pthread_mutex_lock(&w->lock);
+    t->next = NULL;
+    t->front = w->tail;
+    if (w->tail != NULL) {
+        w->tail->next = t;
+    } else {
+        w->head = t;
     }
+    w->tail = t;
+    pthread_mutex_unlock(&w->lock);
 
-    return 0;
+    pthread_mutex_lock(&pool_lock);
+    nqueued++;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
 }
 
-void parseargs(int argc, char **argv) {
-    int c, status = 0;
-    while ((c = getopt(argc, argv, "p:")) != EOF) {
-        switch (c) {
-            case 'p':
-                port = strtol(optarg, NULL, 0);
-                break;
-            default:
-                status++;
+/*
+ * Take the task at the back of the deque of worker w, NULL if it is empty.
+ */
+struct bot_task *pop_task(struct bot_worker *w) {
+    pthread_mutex_lock(&w->lock);
+    struct bot_task *t = w->tail;
+    if (t != NULL) {
+        w->tail = t->front;
+        if (w->tail != NULL) {
+            w->tail->next = NULL;
+        } else {
+            w->head = NULL;
         }
     }
-    if (status || optind != argc) {
-        fprintf(stderr, "usage: %s [-p port]\n", argv[0]);
-        exit(1);
-    }
+    pthread_mutex_unlock(&w->lock);
+    return t;
 }
 
-void makelistener() {
-    struct sockaddr_in r;
-
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(1);
+/*
+ * Queue the tasks of the next depth of job on worker w, the best pit of
+ * the last depth first so it raises alpha early. Called with job->lock
+ * held, or before any task of job runs.
+ */
+void push_depth(struct bot_worker *w, struct bot_job *job) {
+    const int *row = job->board + job->me * (job->npits + 1);
+    job->depth++;
+    job->alpha = -BOT_INF;
+    job->cand = -1;
+    job->cutoff = 0;
+    job->pending = 0;
+    for (int i = 0; i < job->npits; i++) {
+        job->pending += (row[i] > 0);
     }
 
-    int on = 1;
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
-                   (const char *) &on, sizeof(on)) == -1) {
-        perror("setsockopt");
-        exit(1);
+    // pushed last, taken first by w
+    int order[MAXPITS], n = 0;
+    for (int i = 0; i < job->npits; i++) {
+        if (row[i] > 0 && i != job->best) {
+            order[n++] = i;
+        }
     }
-
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(port);
-    if (bind(listenfd, (struct sockaddr *)&r, sizeof(r))) {
-        perror("bind");
-        exit(1);
+    if (row[job->best] > 0) {
+        order[n++] = job->best;
     }
-
-    if (listen(listenfd, 5)) {
-        perror("listen");
-        exit(1);
+    __atomic_add_fetch(&job->refs, n, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) {
+        job->tasks[i].job = job;
+        job->tasks[i].pit = order[i];
+        push_task(w, &job->tasks[i]);
     }
 }
 
-/* call this BEFORE linking the new player in to the list */
-int compute_average_pebbles() {
-    struct player *p;
-    int i;
-
-    if (playerlist == NULL) {
-        return NPEBBLES;
+/*
+ * Search the pit of task t to the depth of its job on the board of worker w.
+ * The last task of a depth publishes its best pit and queues the next depth.
+ */
+void run_task(struct bot_worker *w, struct bot_task *t) {
+    struct bot_job *job = t->job;
+    if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED) == 1 || now_ns() > job->deadline) {
+        return;
     }
+    if (job->nplayers > w->cap) {
+        w->cap = job->nplayers;
+        if ((w->sim.board = realloc(w->sim.board, sizeof(int) * (MAXPITS + 1) * w->cap)) == NULL
+            || (w->sim.nonempty = realloc(w->sim.nonempty, sizeof(int) * w->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    sim_load(&w->sim, job->board, job->nplayers, job->npits);
 
-    int nplayers = 0, npebbles = 0;
-    for (p = playerlist; p; p = p->next) {
-        nplayers++;
-        for (i = 0; i < NPITS; i++) {
-            npebbles += p->pits[i];
+    pthread_mutex_lock(&job->lock);
+    int depth = job->depth;
+    int alpha = job->alpha;
+    pthread_mutex_unlock(&job->lock);
+
+    w->job = job;
+    w->nodes = 0;
+    w->aborted = 0;
+    w->cutoff = 0;
+    int pebbles = sim_move(&w->sim, job->me, t->pit);
+    int score = bot_search(w, depth - 1, alpha, BOT_INF);
+    sim_undo(&w->sim, job->me, t->pit, pebbles);
+
+    pthread_mutex_lock(&job->lock);
+    job->nodes += w->nodes;
+    if (w->aborted == 0) {
+        job->cutoff |= w->cutoff;
+        if (job->cand == -1 || score > job->alpha) {
+            job->alpha = score;
+            job->cand = t->pit;
+        }
+        if (--job->pending == 0) {
+            job->best = job->cand;
+            job->depth_done = depth;
+            // a depth without cutoff searched every line to the end of the game
+            if (job->cutoff == 1 && depth < BOTDEPTH) {
+                push_depth(w, job);
+            }
         }
     }
-    return ((npebbles - 1) / nplayers / NPITS + 1);  /* round up */
+    pthread_mutex_unlock(&job->lock);
 }
 
-int game_is_over() { /* boolean */
-    int i;
+/*
+ * Alpha-beta search of the board of worker w, depth plies deep. The bot
+ * maximizes its score, every other player is assumed to minimize it.
+ */
+int bot_search(struct bot_worker *w, int depth, int alpha, int beta) {
+    struct sim *b = &w->sim;
+    int me = w->job->me;
 
-    if (!playerlist) {
-        return 0;  /* we haven't even started yet! */
+    // look at the clock every 4096 nodes only
+    if ((++w->nodes & 4095) == 0 && (__atomic_load_n(&w->job->stop, __ATOMIC_RELAXED) == 1
+                                     || now_ns() > w->job->deadline)) {
+        w->aborted = 1;
+    }
+    if (w->aborted == 1) {
+        return 0;
+    }
+    if (b->nempty > 0) {    // game over, worth more than any board
+        return 16 * sim_eval(b, me);
+    }
+    if (depth == 0) {
+        w->cutoff = 1;
+        return sim_eval(b, me);
     }
 
-    for (struct player *p = playerlist; p; p = p->next) {
-        int is_all_empty = 1;
-        for (i = 0; i < NPITS; i++) {
-            if (p->pits[i]) {
-                is_all_empty = 0;
-            }
+    int seat = b->current;
+    const int *row = b->board + seat * (b->npits + 1);
+    int maximize = (seat == me);
+    int best = maximize ? -BOT_INF : BOT_INF;
+    for (int pit = b->npits - 1; pit >= 0 && alpha < beta; pit--) {
+        if (row[pit] == 0) {
+            continue;
         }
-        if (is_all_empty) {
-            return 1;
+        int pebbles = sim_move(b, seat, pit);
+        int score = bot_search(w, depth - 1, alpha, beta);
+        sim_undo(b, seat, pit, pebbles);
+        if (maximize && score > best) {
+            best = score;
+            alpha = (score > alpha) ? score : alpha;
+        } else if (!maximize && score < best) {
+            best = score;
+            beta = (score < beta) ? score : beta;
         }
     }
-    return 0;
+    return best;
 }
 
 /*
- * Broadcast the message s to all the players excpets the player not_announce.
+ * Return how much better row me is off than the average row of b, counting
+ * what end_game() counts, with the end pits twice since they are safe.
  */
-void broadcast(char *s, struct player *not_announce) {
-    for (struct player* p = playerlist; p; p = p->next) {
-        if (p != not_announce && p->wait_for_username == 0) {
-            if (write(p->fd, s, strlen(s) + 1) != (strlen(s) + 1)) {
-                perror("Server: broadcast");
-                exit(1);
-            }
+int sim_eval(struct sim *b, int me) {
+    int mine = 0, total = 0;
+    for (int r = 0; r < b->nplayers; r++) {
+        const int *row = b->board + r * (b->npits + 1);
+        int points = 2 * row[b->npits];
+        for (int i = 0; i < b->npits; i++) {
+            points += row[i];
+        }
+        total += points;
+        if (r == me) {
+            mine = points;
         }
     }
+    return mine * b->nplayers - total;
 }
 
 /*
- * Accept the connection request from listenfd.
- * Return 0 if successfully connected,
- * otherwise there is a disconnection and return clientfd.
+ * Play pit of row seat on b as turn_game() does, and set b->current to
+ * the row that plays next. Return the pebbles taken, for sim_undo().
  */
-int accept_connection(int listenfd) { // the file descriptor used for listen
-    int client_fd = accept(listenfd, NULL, NULL);
-    printf(REQUIRE_CONNECT);
-    if (client_fd < 0) {
-        perror("server: accept");
-        close(listenfd);
-        exit(1);
+int sim_move(struct sim *b, int seat, int pit) {
+    int pebbles = b->board[seat * (b->npits + 1) + pit];
+    int ring = b->nplayers * b->npits + 1;
+    int laps = pebbles / ring;
+
+    sim_add(b, seat, pit, -pebbles);
+    if (laps > 0) {
+        sim_laps(b, seat, laps);
     }
-    if (write(client_fd, WELCOME, WELCOME_SIZE) != WELCOME_SIZE) {
-        perror("server: write");
-        exit(1);
+    int again = sim_sow(b, seat, pit, pebbles - laps * ring, 1);
+    if (again) {
+        b->current = seat;
+    } else {    // the row of the next player, as get_next_player()
+        b->current = (seat == 0) ? b->nplayers - 1 : seat - 1;
     }
-    initialize_player(client_fd);
-    return client_fd;
+    return pebbles;
 }
 
 /*
- * Reset the numbers of peddles in each pits of current player.
+ * Take back the move of pit of row seat on b, which took pebbles.
  */
-void reset_pits(struct player *current_player, int pebbles) {
-    for (int i = 0; i < NPITS; i++) {
-        current_player->pits[i] = pebbles;
+void sim_undo(struct sim *b, int seat, int pit, int pebbles) {
+    int ring = b->nplayers * b->npits + 1;
+    int laps = pebbles / ring;
+
+    sim_sow(b, seat, pit, pebbles - laps * ring, -1);
+    if (laps > 0) {
+        sim_laps(b, seat, -laps);
     }
+    sim_add(b, seat, pit, pebbles);
+    b->current = seat;
 }
 
 /*
- * Initialize the player struct with given client_fd, add to linked list.
+ * Add d to each of the pebbles pits after pit of row seat, in the order
+ * of turn_game(), at most once around. Return 1 if the last one is the
+ * end pit of seat, which plays again.
  */
-void initialize_player(int client_fd) {
-    struct player *new_player = malloc(sizeof(struct player));
-
-    new_player->fd = client_fd;
-
-    if (playerlist == NULL) { // it is the first player
-        reset_pits(new_player, NPEBBLES);   // avoid setting end pits
-        new_player->next = playerlist;
-        playerlist = new_player;
-        new_player->front = NULL;
-    } else {
-        int average_pebbles = compute_average_pebbles();
-        reset_pits(new_player, average_pebbles);
-
-        new_player->next = playerlist;
-        playerlist = new_player;
-        new_player->next->front = new_player;
-        new_player->front = NULL;
+int sim_sow(struct sim *b, int seat, int pit, int pebbles, int d) {
+    int again = (pebbles == b->npits - pit);
+    for (int i = pit + 1; i <= b->npits && pebbles > 0; i++, pebbles--) {
+        sim_add(b, seat, i, d);
     }
-    new_player->pits[NPITS] = 0;
-
-    new_player->wait_for_username = 1;
-    new_player->play = 0;
-    new_player->disconnect = 0;
-    new_player->get_full_name = 0;
-    new_player->inbuf = 0;
-
-    for (struct player *p = playerlist; p; p = p->next) {
-        p->head = new_player;
+    for (int s = seat; pebbles > 0; ) {
+        s = (s == 0) ? b->nplayers - 1 : s - 1;
+        int to = (s == seat) ? b->npits + 1 : b->npits;
+        for (int i = 0; i < to && pebbles > 0; i++, pebbles--) {
+            sim_add(b, s, i, d);
+        }
     }
+    return again;
 }
 
-
 /*
- * Return the index of first occurrence of \n,
- * otherwise return -1.
+ * Add laps to every pit of b but the end pits of the rows other than seat.
  */
-int find_newline(const char *buf, int n) {
-    for (int i = 0; i < n; i++) {
-        if (buf[i] == '\r') {
-            return i;
-        } else if (buf[i] == '\n') {
-            return i;
+void sim_laps(struct sim *b, int seat, int laps) {
+    for (int r = 0; r < b->nplayers; r++) {
+        for (int i = 0; i < b->npits; i++) {
+            sim_add(b, r, i, laps);
         }
     }
-    return -1;
+    b->board[seat * (b->npits + 1) + b->npits] += laps;
 }
 
 /*
- * Return the whole line at once.
+ * Add d to pit of row of b, keeping the nonempty and nempty counts.
  */
-char *read_from(int fd) {
-    char buf[MAXMESSAGE + 1] = {'\0'};
-    int inbuf = 0;           // number bytes currently in buf
-    int room = MAXMESSAGE + 1;  // number bytes remaining in buf
-    int newline_flag = -1;
-    int nbytes;
-    char *whole_line = malloc(sizeof(char) * (MAXMESSAGE + 1));
-
-    // Continue reading until gets newline character
-    while (newline_flag < 0 && (nbytes = read(fd, &buf, room)) > 0) {
-        if (nbytes == 0) {
-            get_player(fd)->disconnect = 1;
+void sim_add(struct sim *b, int row, int pit, int d) {
+    int *x = &b->board[row * (b->npits + 1) + pit];
+    if (pit < b->npits) {
+        if (*x == 0 && d > 0 && b->nonempty[row]++ == 0) {
+            b->nempty--;
+        } else if (*x > 0 && *x + d == 0 && --b->nonempty[row] == 0) {
+            b->nempty++;
         }
+    }
+    *x += d;
+}
 
-        inbuf += nbytes;
-        if ((newline_flag = find_newline(buf, inbuf)) < 0) {
-            room -= nbytes;
+/*
+ * Copy board of nplayers rows of npits pits into b and count its empty pits
+ * and rows.
+ */
+void sim_load(struct sim *b, const int *board, int nplayers, int npits) {
+    b->nplayers = nplayers;
+    b->npits = npits;
+    b->nempty = 0;
+    memcpy(b->board, board, sizeof(int) * (npits + 1) * nplayers);
+    for (int r = 0; r < nplayers; r++) {
+        b->nonempty[r] = 0;
+        for (int i = 0; i < npits; i++) {
+            b->nonempty[r] += (board[r * (npits + 1) + i] > 0);
         }
-        strncat(whole_line, buf, room);
-        room -= nbytes;
-    }
-    if (nbytes == 0) {
-        get_player(fd)->disconnect = 1;
+        b->nempty += (b->nonempty[r] == 0);
     }
-
-    whole_line[find_newline(whole_line, strlen(whole_line))] = '\0';
-    return whole_line;
 }
 
 /*
- * Disconnect the passed in fd in the fd set all_fds.
+ * Let bench_players bots play a game against each other, each move
+ * searched for bot_ms, and print the nodes searched per second.
  */
-void disconnect_invalid_name(int fd, fd_set all_fds) {
-    FD_CLR(fd, &all_fds);
-    disconnect(fd);
-    printf("%s", INVALID_NAME_DISCONNECT);
+void run_bench() {
+    struct sim b;
+    int nplayers = bench_players;
+    int npits = default_pits;
+    int start_board[(npits + 1) * nplayers];
+    if ((b.board = malloc(sizeof(start_board))) == NULL
+        || (b.nonempty = malloc(sizeof(int) * nplayers)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < (npits + 1) * nplayers; i++) {
+        start_board[i] = (i % (npits + 1) == npits) ? 0 : default_pebbles;
+    }
+    sim_load(&b, start_board, nplayers, npits);
+    b.current = 0;  // the oldest player, in the first row, moves first as in read_name()
+
+    long nodes = 0, depths = 0;
+    int moves = 0;
+    long long start = now_ns();
+    while (b.nempty == 0 && moves < BENCHMOVES) {
+        struct bot_job *job = start_job(b.board, nplayers, npits, b.current);
+        struct timespec ts = { bot_ms / 1000, (bot_ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+
+        long n;
+        int pit = stop_job(job, &n);
+        pthread_mutex_lock(&job->lock);
+        depths += job->depth_done;
+        pthread_mutex_unlock(&job->lock);
+        release_job(job);
+        nodes += n;
+        sim_move(&b, b.current, pit);
+        moves++;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%d bot(s), %d move(s) of %dms on %d thread(s): %ld nodes, %.0f nodes/s, depth %.1f on average\n",
+           nplayers, moves, bot_ms, nworkers, nodes, nodes / secs, (moves > 0) ? (double)depths / moves : 0.0);
 }
 
 /*
- * Display the game state to all the players and the server.
+ * Time get_player() and find_name() at 100, 1000 and 10000 connections
+ * against walking the whole playerlist, as both lookups did before the
+ * connection table and the name table, and print the time per lookup.
  */
-void display_game_state() {
-    int num_players = get_number_players();
-    char *game_state = malloc(sizeof(char) * (MAXNAME + 2 + MAXMESSAGE + 3) * num_players);
+void run_lookup_bench() {
+    int sizes[] = { 100, 1000, 10000 };
+    unsigned long long rng = 0x9E3779B97F4A7C15ULL;
+    struct player *found = NULL;
+    long check = 0; // adds up the fds found, so no lookup can be optimized away
 
-    for (struct player* p = playerlist; p; p = p->next) {
-        if (p->wait_for_username == 0) {
-            char line[MAXNAME + 2 + MAXMESSAGE + 3];
-            sprintf(line, "%s:", p->name);
+    printf("players    walk fd    get_player    walk name    find_name\n");
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        struct player *players = calloc(n, sizeof(struct player));
+        int *keys = malloc(sizeof(int) * n);
+        if (players == NULL || keys == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        struct player *list = NULL;
+        for (int i = 0; i < n; i++) {
+            struct player *p = &players[i];
+            p->fd = i + 3;  // after stdin, stdout and stderr, as accept() hands them out
+            snprintf(p->name, sizeof(p->name), "player%d", i);
+            p->next = list;
+            list = p;
+            add_conn(p);
+            add_name(p);
+        }
+        for (int i = 0; i < n; i++) {   // the players looked up, in random order
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            keys[i] = ((rng >> 32) * n) >> 32;
+        }
 
-            for (int i = 0; i < NPITS; i++) {
-                char pit_state[MAXMESSAGE] = {'\0'};
-                sprintf(pit_state, " [%d]%d", i, p->pits[i]);
-                strncat(line, pit_state, strlen(pit_state) + 1);
+        // a walk compares all n players, so there are n times fewer of them
+        int walks = BENCHLOOKUPS / n, lookups = BENCHLOOKUPS;
+        double ns[4];
+        long long start = now_ns();
+        for (int i = 0; i < walks; i++) {
+            int fd = players[keys[i % n]].fd;
+            for (struct player *p = list; p; p = p->next) {
+                if (p->fd == fd) {
+                    found = p;
+                }
+            }
+            check += found->fd;
+        }
+        ns[0] = (double)(now_ns() - start) / walks;
+        start = now_ns();
+        for (int i = 0; i < lookups; i++) {
+            check += get_player(players[keys[i % n]].fd)->fd;
+        }
+        ns[1] = (double)(now_ns() - start) / lookups;
+        start = now_ns();
+        for (int i = 0; i < walks; i++) {
+            const char *name = players[keys[i % n]].name;
+            for (struct player *p = list; p; p = p->next) {
+                if (strcmp(p->name, name) == 0) {
+                    found = p;
+                }
             }
-            char pit_state[MAXMESSAGE] = {'\0'};
-            sprintf(pit_state, " [end pit]%d\r\n", p->pits[NPITS]);
-            strncat(line, pit_state, strlen(pit_state) + 1);
-            strncat(game_state, line, strlen(line) + 1);
+            check += found->fd;
+        }
+        ns[2] = (double)(now_ns() - start) / walks;
+        start = now_ns();
+        for (int i = 0; i < lookups; i++) {
+            check += find_name(players[keys[i % n]].name)->fd;
+        }
+        ns[3] = (double)(now_ns() - start) / lookups;
+
+        printf("%7d %10.1fns %10.1fns %10.1fns %10.1fns\n", n, ns[0], ns[1], ns[2], ns[3]);
+        for (int i = 0; i < n; i++) {
+            remove_conn(players[i].fd);
+            remove_name(&players[i]);
         }
+        free(players);
+        free(keys);
     }
-    broadcast(game_state, NULL);
-    printf("%s", game_state);
+    printf("checksum %ld\n", check);
 }
 
 /*
- * Remove the player with disconnect_fd from the playerlist.
- * Return the name of the disconnected player if avaliable.
+ * Time turn_game() on moves of 10 to 10000 pebbles at 2, 8 and 32 players
+ * against sow_pebbles(), which sows one pebble at a time as turn_game() did
+ * before whole laps, and print the time per move of both.
  */
-char *disconnect(int disconnect_fd) {
-    struct player *disconnect_player = get_player(disconnect_fd);
-    char *disconnect_name = malloc(sizeof(char) * (MAXNAME + 1));
-    disconnect_player->disconnect = 1;
-
-    if (disconnect_player->wait_for_username == 0) {
-        strncpy(disconnect_name, disconnect_player->name, MAXNAME + 1);
-    } else {
-        strncpy(disconnect_name, INVALID_NAME_DISCONNECT, MAXNAME + 1);
-    }
+void run_sow_bench() {
+    int sizes[] = { 2, 8, 32 };
+    int counts[] = { 10, 100, 1000, 10000 };
 
-    // disconnect when it is his turn play
-    if (disconnect_player->play == 1) {
-        get_next_player(disconnect_player)->play = 1;
-    }
-
-    if (get_number_players() == 1
-        && get_current_player() == disconnect_player) {   // disconnects only player in the game
-        playerlist = NULL;
-    } else if (disconnect_player->next == NULL
-               && disconnect_player->front == NULL) {   // disconnect only player not in the game
-        playerlist = NULL;
-    } else if (disconnect_player->head == disconnect_player) {  // disconnect the head
-        struct player *new_head = disconnect_player->next;
-        new_head->front = NULL;
-        playerlist = new_head;
-        for (struct player *p = playerlist; p; p = p->next) {
-            p->head = new_head;
-        }
-    } else if (disconnect_player->next == NULL) {   // disconnect the tail
-        disconnect_player->front->next = NULL;
-    } else {    // disconnect middle player
-        struct player *next = disconnect_player->next;
-        struct player *front = disconnect_player->front;
-        front->next = next;
-        next->front = front;
+    log_level = LOG_OFF;
+    name_timeout = 0;
+    stats = &allstats[0];
+    logs = &alllogs[0];
+    printf("board %dx%d\n", default_pits, default_pebbles);
+    printf("players  pebbles    per pebble    turn_game   speedup\n");
+    for (int s = 0; s < 3; s++) {
+        for (int c = 0; c < 4; c++) {
+            int pebbles = counts[c];
+            int moves = BENCHSOWS / pebbles;
+            struct game *games[2];
+            double ns[2];
+            for (int k = 0; k < 2; k++) {
+                struct game *g = games[k] = new_game(default_pits, default_pebbles);
+                for (int i = 0; i < sizes[s]; i++) {
+                    batch_seat(g);
+                }
+                // the oldest player plays his first pit over and over
+                struct player *p = g->seats[0];
+                long long start = now_ns();
+                for (int i = 0; i < moves; i++) {
+                    set_pit(p, 0, pebbles);
+                    if (k == 0) {
+                        sow_pebbles(p, 0);
+                    } else {
+                        turn_game(p, 0);
+                    }
+                }
+                ns[k] = (double)(now_ns() - start) / moves;
+            }
+            int size = sizes[s] * (default_pits + 1);
+            int same = (memcmp(games[0]->board, games[1]->board, sizeof(int) * size) == 0
+                        && games[0]->nempty == games[1]->nempty);
+            printf("%7d %8d %11.1fns %10.1fns %8.1fx%s\n", sizes[s], pebbles, ns[0], ns[1], ns[0] / ns[1],
+                   same ? "" : "  boards differ");
+            end_game(games[0]);
+            end_game(games[1]);
+            pool_players();
+        }
     }
-
-    return disconnect_name;
 }
 
 /*
- * Play game in one turn.
+ * Play pit_index of turn_player one pebble at a time, walking playerlist
+ * from row to row, as turn_game() did before it added whole laps at once.
+ * Only run_sow_bench() calls it.
  */
-void turn_game(struct player *turn_player, int pit_index) {
+void sow_pebbles(struct player *turn_player, int pit_index) {
     struct player *current_distribute = turn_player;
+    struct game *g = turn_player->game;
     int distribute_pit_index = pit_index + 1;
     int pebbles = turn_player->pits[pit_index]; // number of pits to distribute
     int play_again = 0; // set to 0 if current player can play again
 
     turn_player->pits[pit_index] = 0;
+    if (--turn_player->nonempty == 0) {
+        g->nempty++;
+    }
 
     while (pebbles > 0) {
-        // distribute the pebbles on the side of player himself
-        if (current_distribute == turn_player) {
-            while (distribute_pit_index < (NPITS + 1) && pebbles > 0) {
-                current_distribute->pits[distribute_pit_index] += 1;
-                pebbles -= 1;
-                distribute_pit_index += 1;
-            }
-
-            // check whether play again
-            if (distribute_pit_index == (NPITS + 1) && pebbles == 0) {  // play again
-                play_again = 1;
-            }
-        } else {    // distribute the pebbles on the side of other players
-            while (distribute_pit_index < NPITS && pebbles > 0) {
-                current_distribute->pits[distribute_pit_index] += 1;
-                pebbles -= 1;
-                distribute_pit_index += 1;
+        // his own side goes up to his end pit, the other sides stop before theirs
+        int end = (current_distribute == turn_player) ? g->npits + 1 : g->npits;
+        while (distribute_pit_index < end && pebbles > 0) {
+            if (distribute_pit_index < g->npits && current_distribute->pits[distribute_pit_index] == 0
+                && current_distribute->nonempty++ == 0) {
+                g->nempty--;
             }
+            current_distribute->pits[distribute_pit_index] += 1;
+            pebbles -= 1;
+            distribute_pit_index += 1;
+        }
+        if (current_distribute == turn_player && distribute_pit_index == g->npits + 1 && pebbles == 0) {
+            play_again = 1;
         }
 
         if (pebbles > 0) {
             if (current_distribute->next == NULL) {
-                current_distribute = current_distribute->head;
+                current_distribute = g->playerlist;
             } else {
                 current_distribute = current_distribute->next;
             }
@@ -631,64 +5222,232 @@ void turn_game(struct player *turn_player, int pit_index) {
     }
 
     if (play_again == 0) {
-        turn_player->play = 0;
-        get_next_player(turn_player)->play = 1;
+        g->current = get_next_player(turn_player);
     }
 }
 
-
 /*
- * Get number of player in the game pool.
+ * Play batch_games games without clients on nthreads threads, through the
+ * same seat_player(), turn_game() and game_is_over() as the server, and
+ * print the totals and the games played per second.
  */
-int get_number_players() {
-    int players = 0;
-    for (struct player *p = playerlist; p; p = p->next) {
-        if (p->wait_for_username == 0) {
-            players++;
+void run_batch() {
+    log_level = LOG_OFF;
+    name_timeout = 0;
+    if (max_seats > 0) {
+        batch_players = max_seats;
+    }
+    if (batch_path != NULL && (batch_out = fopen(batch_path, "w")) == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    struct batch_stats *all = calloc(nthreads, sizeof(struct batch_stats));
+    pthread_t *tids = malloc(sizeof(pthread_t) * nthreads);
+    if (all == NULL || tids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long long start = now_ns();
+    for (int i = 1; i < nthreads; i++) {
+        if ((errno = pthread_create(&tids[i], NULL, run_batch_thread, &all[i])) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    run_batch_thread(&all[0]);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    if (batch_out != NULL && fclose(batch_out) == EOF) {
+        perror("fclose");
+        exit(1);
+    }
+
+    // thread 0 keeps the totals
+    struct batch_stats *t = &all[0];
+    for (int i = 1; i < nthreads; i++) {
+        struct batch_stats *bs = &all[i];
+        if (bs->games > 0 && (t->games == 0 || bs->min_moves < t->min_moves)) {
+            t->min_moves = bs->min_moves;
+        }
+        if (bs->max_moves > t->max_moves) {
+            t->max_moves = bs->max_moves;
+        }
+        t->games += bs->games;
+        t->moves += bs->moves;
+        t->extra += bs->extra;
+        t->unfinished += bs->unfinished;
+        t->draws += bs->draws;
+        for (int s = 0; s < batch_players; s++) {
+            t->seated[s] += bs->seated[s];
+            t->wins[s] += bs->wins[s];
+            t->points[s] += bs->points[s];
+        }
+    }
+
+    printf("Simulated %ld game(s) of %d player(s) in %.3fs on %d thread(s), %.0f games/s.\n",
+           t->games, batch_players, secs, nthreads, (secs > 0) ? t->games / secs : 0.0);
+    if (t->games == 0) {
+        return;
+    }
+    printf("Moves per game: %.1f on average, %d to %d, %ld game(s) stopped unfinished.\n",
+           (double)t->moves / t->games, t->min_moves, t->max_moves, t->unfinished);
+    printf("Extra turns: %.1f%% of the moves. Draws: %.2f%% of the games.\n",
+           (t->moves > 0) ? 100.0 * t->extra / t->moves : 0.0, 100.0 * t->draws / t->games);
+    for (int s = 0; s < batch_players; s++) {
+        if (t->seated[s] > 0) {
+            printf("seat %d: %.2f%% wins, %.2f points on average\n", s,
+                   100.0 * t->wins[s] / t->seated[s], (double)t->points[s] / t->seated[s]);
         }
     }
-    return players;
 }
 
 /*
- * Get the player with input fd.
+ * Play this thread's share of the batch_games games into the totals at arg.
  */
-struct player*get_player(int fd) {
-    struct player *player = NULL;
-    for (struct player *p = playerlist; p; p = p->next) {
-        if (p->fd == fd) {
-            player = p;
+void *run_batch_thread(void *arg) {
+    struct batch_stats *bs = arg;
+    int shard = __sync_fetch_and_add(&nstats, 1);
+    stats = &allstats[shard];
+    logs = &alllogs[shard];
+
+    int ncolumns = 3 + batch_players;
+    int *columns = malloc(sizeof(int) * ncolumns * BATCHROWS);
+    bs->seated = calloc(batch_players, sizeof(long));
+    bs->wins = calloc(batch_players, sizeof(long));
+    bs->points = calloc(batch_players, sizeof(long));
+    if (columns == NULL || bs->seated == NULL || bs->wins == NULL || bs->points == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned long long rng = 0x9E3779B97F4A7C15ULL * (shard + 1);  // the same games on every run
+    long ngames = batch_games / nthreads + (shard < batch_games % nthreads);
+    int nrows = 0;
+
+    for (long n = 0; n < ngames; n++) {
+        struct game *g = new_game(default_pits, default_pebbles);
+        int seated = (batch_join >= 0) ? batch_players - 1 : batch_players;
+        for (int i = 0; i < seated; i++) {
+            batch_seat(g);
+        }
+        g->current = g->seats[0];   // the first player to join begins, as in read_name()
+
+        int moves = 0, extra = 0;
+        while (!game_is_over(g) && moves < BATCHMAXMOVES) {
+            if (moves == batch_join && g->nplayers < batch_players) {
+                batch_seat(g);
+            }
+            struct player *p = get_current_player(g);
+            turn_game(p, batch_pit(p, &rng));
+            moves++;
+            extra += (get_current_player(g) == p);
+        }
+
+        int winner = -1, best = -1;
+        for (int s = 0; s < batch_players; s++) {
+            int points = -1;
+            if (s < g->nplayers) {
+                points = 0;
+                for (int i = 0; i <= g->npits; i++) {
+                    points += g->seats[s]->pits[i];
+                }
+                bs->seated[s]++;
+                bs->points[s] += points;
+                if (points > best) {
+                    best = points;
+                    winner = s;
+                } else if (points == best) {
+                    winner = -1;
+                }
+            }
+            columns[(3 + s) * BATCHROWS + nrows] = points;
+        }
+        if (winner == -1) {
+            bs->draws++;
+        } else {
+            bs->wins[winner]++;
+        }
+        columns[nrows] = moves;
+        columns[BATCHROWS + nrows] = extra;
+        columns[2 * BATCHROWS + nrows] = winner;
+
+        if (bs->games == 0 || moves < bs->min_moves) {
+            bs->min_moves = moves;
+        }
+        if (moves > bs->max_moves) {
+            bs->max_moves = moves;
+        }
+        bs->games++;
+        bs->moves += moves;
+        bs->extra += extra;
+        bs->unfinished += !game_is_over(g);
+
+        end_game(g);
+        pool_players();
+        if (++nrows == BATCHROWS) {
+            write_batch(columns, nrows, ncolumns);
+            nrows = 0;
         }
     }
-    return player;
+    write_batch(columns, nrows, ncolumns);
+    free(columns);
+    return NULL;
 }
 
 /*
- * Return the next player of current_player in the game.
+ * Seat a player without a connection in the simulated game g.
  */
-struct player *get_next_player(struct player *current_player) {
-    struct player *next_player = NULL;
-    if (current_player->next != NULL) {
-        next_player = current_player->next;
-    } else {
-        next_player = current_player->head;
-        while (next_player->wait_for_username != 0) {
-            next_player = next_player->next;
-        }
-    }
-    return next_player;
+void batch_seat(struct game *g) {
+    initialize_player(-1);
+    struct player *p = lobby;
+    p->wait_for_username = 0;
+    p->name[0] = '\0';
+    seat_player(p, g);
 }
 
 /*
- * Return the player who plays the current turn.
+ * Return the pit the simulated player p plays, by batch_policy: any pit at
+ * random, or the one closest to the end pit that gives an extra turn first.
  */
-struct player *get_current_player() {
-    for (struct player *p = playerlist; p; p = p->next) {
-        if (p->play == 1) {
-            return p;
+int batch_pit(struct player *p, unsigned long long *rng) {
+    int npits = p->game->npits;
+    int ring = p->game->nplayers * npits + 1;
+    int pits[MAXPITS], n = 0;
+    for (int i = npits - 1; i >= 0; i--) {
+        if (batch_policy == POLICY_EXTRA && p->pits[i] > 0 && p->pits[i] % ring == npits - i) {
+            return i;
         }
+        pits[n] = i;
+        n += (p->pits[i] > 0);  // no branch to mispredict on random boards
     }
-    return NULL;
-}
 
+    // xorshift64, its high half scaled to n instead of a division
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return pits[((*rng >> 32) * n) >> 32];
+}
 
+/*
+ * Append the first nrows rows of the ncolumns columns of BATCHROWS ints to
+ * batch_out as one block, if there is one.
+ */
+void write_batch(int *columns, int nrows, int ncolumns) {
+    if (batch_out == NULL || nrows == 0) {
+        return;
+    }
+    struct batch_block header = { nrows, ncolumns };
+    int failed = 0;
+    pthread_mutex_lock(&batch_lock);
+    failed |= (fwrite(&header, sizeof(header), 1, batch_out) != 1);
+    for (int c = 0; c < ncolumns; c++) {
+        failed |= (fwrite(columns + c * BATCHROWS, sizeof(int), nrows, batch_out) != (size_t)nrows);
+    }
+    pthread_mutex_unlock(&batch_lock);
+    if (failed) {
+        perror("fwrite");
+        exit(1);
+    }
+}